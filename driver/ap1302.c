@@ -8,26 +8,45 @@
 #include <linux/clk.h>
 #include <linux/clk-provider.h>
 #include <linux/clkdev.h>
+#include <linux/completion.h>
 #include <linux/ctype.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/firmware.h>
+#include <linux/gcd.h>
 #include <linux/gpio/consumer.h>
 #include <linux/i2c.h>
 #include <linux/init.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/of_device.h>
+#include <linux/overflow.h>
 #include <linux/regmap.h>
 #include <linux/regulator/consumer.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include <linux/xz.h>
+#include <linux/zstd.h>
+#include <asm/unaligned.h>
 #include <media/v4l2-async.h>
 #include <media/v4l2-ctrls.h>
 #include <media/v4l2-device.h>
 #include <media/v4l2-event.h>
 #include <media/v4l2-fwnode.h>
+#include <media/v4l2-rect.h>
 #include <media/v4l2-subdev.h>
 
+#define CREATE_TRACE_POINTS
+#include "ap1302_trace.h"
+
 /* min/typical/max system clock (xclk) frequencies */
 #define AP1302_XCLK_MIN  6000000
 #define AP1302_XCLK_MAX 54000000
@@ -36,12 +55,28 @@
 
 #define AP1302_FW_WINDOW_SIZE            0x2000
 #define AP1302_FW_WINDOW_OFFSET            0x8000
+/* Firmware upload burst length before the AP1302 PLL is locked */
 #define AP1302_FW_BLOCK_LEN         0x800
 #define AP1302_MIN_WIDTH            24U
 #define AP1302_MIN_HEIGHT            16U
 #define AP1302_MAX_WIDTH            4224U
 #define AP1302_MAX_HEIGHT            4092U
 
+/*
+ * Output timings computed for arbitrary sizes: minimum blanking appended to the
+ * active area, and maximum CSI-2 bit rate per data lane. The output runs at
+ * the link pixel rate, the vertical blanking sets the frame rate down to
+ * AP1302_MIN_FPS.
+ */
+#define AP1302_MIN_HBLANK            128U
+#define AP1302_MIN_VBLANK            40U
+#define AP1302_MIN_FPS                1U
+#define AP1302_DEFAULT_FPS            30U
+#define AP1302_SUBSAMPLING_MAX_WIDTH    1280U
+#define AP1302_SUBSAMPLING_MAX_HEIGHT    960U
+#define AP1302_MIPI_LANE_MAX_RATE    1500000000ULL
+#define AP1302_BITS_PER_PIXEL        16U
+
 #define AP1302_REG_16BIT(n)            ((2 << 24) | (n))
 #define AP1302_REG_32BIT(n)            ((4 << 24) | (n))
 #define AP1302_REG_SIZE(n)            ((n) >> 24)
@@ -63,6 +98,9 @@
 #define AP1302_CON_BUF_SIZE            512
 
 /* Control Registers */
+#define AP1302_CTRL                AP1302_REG_16BIT(0x1000)
+#define AP1302_CTRL_CONTEXT_MASK        (3U << 0)
+#define AP1302_CTRL_CONTEXT(n)            ((n) << 0)
 #define AP1302_DZ_TGT_FCT            AP1302_REG_16BIT(0x1010)
 #define AP1302_SFX_MODE                AP1302_REG_16BIT(0x1016)
 #define AP1302_SFX_MODE_SFX_NORMAL        (0U << 0)
@@ -100,15 +138,15 @@
 #define AP1302_ATOMIC_RECORD            BIT(0)
 
 /*
- * Preview Context Registers (preview_*). AP1302 supports 3 "contexts"
- * (Preview, Snapshot, Video). These can be programmed for different size,
- * format, FPS, etc. There is no functional difference between the contexts,
- * so the only potential benefit of using them is reduced number of register
- * writes when switching output modes (if your concern is atomicity, see
- * "atomic" register).
- * So there's virtually no benefit in using contexts for this driver and it
- * would significantly increase complexity. Let's use preview context only.
+ * Context Registers. AP1302 supports 3 "contexts" (Preview, Snapshot, Video)
+ * with the same register layout, 0x1000 apart. These can be programmed for
+ * different size, format, FPS, ROI, etc. There is no functional difference
+ * between the contexts. The driver programs all of them when the stream
+ * starts, switching output modes then takes a single write to the CTRL
+ * register. The preview_* definitions apply to all contexts through
+ * AP1302_CTX_REG().
  */
+#define AP1302_CTX_REG(reg, ctx)        ((reg) + (ctx) * 0x1000)
 #define AP1302_PREVIEW_WIDTH            AP1302_REG_16BIT(0x2000)
 #define AP1302_PREVIEW_HEIGHT            AP1302_REG_16BIT(0x2002)
 #define AP1302_PREVIEW_ROI_X0            AP1302_REG_16BIT(0x2004)
@@ -159,6 +197,7 @@
 #define AP1302_PREVIEW_OUT_FMT_FST_RAW_GC    (8U << 0)
 #define AP1302_PREVIEW_OUT_FMT_FST_RAW_CURVE    (9U << 0)
 #define AP1302_PREVIEW_OUT_FMT_FST_RAW_CCONV    (10U << 0)
+#define AP1302_PREVIEW_MAX_FPS            AP1302_REG_16BIT(0x2020)
 #define AP1302_PREVIEW_S1_SENSOR_MODE        AP1302_REG_16BIT(0x202e)
 #define AP1302_PREVIEW_HINF_CTRL        AP1302_REG_16BIT(0x2030)
 #define AP1302_PREVIEW_HINF_CTRL_BT656_LE    BIT(15)
@@ -305,6 +344,7 @@
 
 /* Misc Registers */
 #define AP1302_REG_ADV_START            0xe000
+#define AP1302_REG_ADV_END            0xefff
 #define AP1302_ADVANCED_BASE            AP1302_REG_32BIT(0xf038)
 #define AP1302_SIP_CRC                AP1302_REG_16BIT(0xf052)
 #define AP1302_SIP_CHECKSUM           AP1302_REG_16BIT(0x6134)
@@ -377,12 +417,14 @@ enum ap1302_mode_id {
     AP1302_NUM_MODES,
 };
 
-enum ap1302_frame_rate {
-    AP1302_08_FPS = 0,
-    AP1302_15_FPS,
-    AP1302_30_FPS,
-    AP1302_60_FPS,
-    AP1302_NUM_FRAMERATES,
+/* Mode computed at runtime for a size without a preset. */
+#define AP1302_MODE_CUSTOM            AP1302_NUM_MODES
+
+enum ap1302_context_id {
+    AP1302_CTX_PREVIEW = 0,
+    AP1302_CTX_SNAPSHOT,
+    AP1302_CTX_VIDEO,
+    AP1302_NUM_CONTEXTS,
 };
 
 enum ap1302_format_mux {
@@ -415,11 +457,14 @@ module_param(virtual_channel, uint, 0444);
 MODULE_PARM_DESC(virtual_channel,
          "MIPI CSI-2 virtual channel (0..3), default 0");
 
-static const int ap1302_framerates[] = {
-    [AP1302_08_FPS] = 8,
-    [AP1302_15_FPS] = 15,
-    [AP1302_30_FPS] = 30,
-    [AP1302_60_FPS] = 60,
+static bool async_boot;
+module_param(async_boot, bool, 0444);
+MODULE_PARM_DESC(async_boot,
+         "Load the firmware and boot the ISP off the probe path, default 0");
+
+/* Frame rates enumerated to userspace, any interval can be set */
+static const unsigned int ap1302_framerates[] = {
+    5, 8, 10, 15, 24, 25, 30, 50, 60, 120,
 };
 
 /* regulator supplies */
@@ -436,22 +481,270 @@ struct ap1302_firmware_header {
     u16 crc;
 } __packed;
 
+/*
+ * Header of the firmware image stored in the SPI flash attached to the
+ * AP1302, followed by a copy of the uncompressed firmware image.
+ */
+struct ap1302_flash_header {
+    __le32 size;
+    struct ap1302_firmware_header fw;
+} __packed;
+
+#define AP1302_SPI_FW_OFFSET        0x0
+
 #define MAX_FW_LOAD_RETRIES 3
 
+/* Readiness polling interval bounds, doubled after every unsuccessful poll */
+#define AP1302_POLL_MIN_US          100
+#define AP1302_POLL_MAX_US          10000
+
+enum ap1302_wait_id {
+    AP1302_WAIT_CHIP_READY = 0,
+    AP1302_WAIT_BOOTDATA,
+    AP1302_WAIT_STALL,
+    AP1302_WAIT_DMA,
+    AP1302_WAIT_PLL_LOCK,
+    AP1302_NUM_WAITS,
+};
+
+struct ap1302_wait_info {
+    const char *name;
+    unsigned int timeout_us;
+    /* Fixed delay previously used for the same wait */
+    unsigned int fixed_us;
+};
+
+static const struct ap1302_wait_info ap1302_waits[AP1302_NUM_WAITS] = {
+    [AP1302_WAIT_CHIP_READY] = { "chip ready", 100000, 10000 },
+    [AP1302_WAIT_BOOTDATA] = { "bootdata checksum", 200000, 40000 },
+    [AP1302_WAIT_STALL] = { "stall", 500000, 200000 },
+    [AP1302_WAIT_DMA] = { "DMA", 100000, 0 },
+    [AP1302_WAIT_PLL_LOCK] = { "PLL lock", 10000, 0 },
+};
+
+static const char * const ap1302_phase_names[AP1302_NUM_PHASES] = {
+#undef EM
+#undef EMe
+#define EM(a, b)    [a] = b,
+#define EMe(a, b)   [a] = b
+    AP1302_BOOT_PHASES
+#undef EM
+#undef EMe
+};
+
+/* Timing breakdown of the last cold boot, exposed through debugfs */
+struct ap1302_boot_stats {
+    ktime_t start;
+    s64 duration_us;
+    s64 phase_us[AP1302_NUM_PHASES];
+    u32 phase_bytes[AP1302_NUM_PHASES];
+    unsigned int retries;
+    bool spi_boot;
+    int ret;
+};
+
+/*
+ * Register access statistics, exposed through debugfs. Registers in the
+ * advanced window are accounted under their paged address. The number of
+ * tracked registers is bounded, accesses to further registers are only
+ * counted as untracked.
+ */
+#define AP1302_STATS_MAX_REGS           512
+#define AP1302_STATS_LAT_BUCKETS        32
+
+struct ap1302_reg_stats {
+    u64 reads;
+    u64 writes;
+    u64 bytes;
+    u64 errors;
+};
+
+struct ap1302_stats {
+    struct mutex lock;
+    struct xarray regs; /* struct ap1302_reg_stats, indexed by register */
+    unsigned int num_regs;
+    u64 untracked;
+    u64 latency[AP1302_STATS_LAT_BUCKETS]; /* bucket n: [2^n, 2^(n+1)) ns */
+};
+
+#define AP1302_SHADOW_CTX_REGS(ctx)                         \
+    AP1302_CTX_REG(AP1302_PREVIEW_WIDTH, ctx),              \
+    AP1302_CTX_REG(AP1302_PREVIEW_HEIGHT, ctx),             \
+    AP1302_CTX_REG(AP1302_PREVIEW_ROI_X0, ctx),             \
+    AP1302_CTX_REG(AP1302_PREVIEW_ROI_Y0, ctx),             \
+    AP1302_CTX_REG(AP1302_PREVIEW_ROI_X1, ctx),             \
+    AP1302_CTX_REG(AP1302_PREVIEW_ROI_Y1, ctx),             \
+    AP1302_CTX_REG(AP1302_PREVIEW_OUT_FMT, ctx),            \
+    AP1302_CTX_REG(AP1302_PREVIEW_MAX_FPS, ctx),            \
+    AP1302_CTX_REG(AP1302_PREVIEW_S1_SENSOR_MODE, ctx),     \
+    AP1302_CTX_REG(AP1302_PREVIEW_HINF_CTRL, ctx)
+
+/*
+ * Configuration registers shadowed in memory. Format and control changes only
+ * update the shadow, the registers that changed are then written to the
+ * hardware in one batch, in this order, when the stream starts.
+ */
+static const u32 ap1302_shadow_regs[] = {
+    AP1302_DZ_TGT_FCT,
+    AP1302_SFX_MODE,
+    AP1302_BUBBLE_OUT_FMT,
+    AP1302_SHADOW_CTX_REGS(AP1302_CTX_PREVIEW),
+    AP1302_SHADOW_CTX_REGS(AP1302_CTX_SNAPSHOT),
+    AP1302_SHADOW_CTX_REGS(AP1302_CTX_VIDEO),
+    AP1302_AE_CTRL,
+    AP1302_AE_MANUAL_GAIN,
+    AP1302_AE_BV_OFF,
+    AP1302_AE_MET,
+    AP1302_AWB_CTRL,
+    AP1302_FLICK_CTRL,
+    AP1302_SCENE_CTRL,
+    AP1302_SENSOR_SELECT,
+    AP1302_BRIGHTNESS,
+    AP1302_CONTRAST,
+    AP1302_SATURATION,
+    AP1302_GAMMA,
+    /* last, the selected context is fully programmed when switching to it */
+    AP1302_CTRL,
+};
+
+#define AP1302_NUM_SHADOW_REGS          ARRAY_SIZE(ap1302_shadow_regs)
+
+/* Queue of register accesses sent as a single I2C transfer */
+#define AP1302_XFER_MAX_MSGS            32
+#define AP1302_XFER_BUF_SIZE            256
+
+struct ap1302_queued_read {
+    u32 *val;
+    const u8 *data;
+    unsigned int size;
+};
+
+struct ap1302_xfer {
+    bool active;
+    unsigned int max_msgs;
+    unsigned int max_write_len;
+    struct i2c_msg msgs[AP1302_XFER_MAX_MSGS];
+    unsigned int num_msgs;
+    struct ap1302_queued_read reads[AP1302_XFER_MAX_MSGS / 2];
+    unsigned int num_reads;
+    u8 buf[AP1302_XFER_BUF_SIZE];
+    unsigned int buf_len;
+    u32 last_reg; /* last register written, 0 if none */
+    unsigned int transfers;
+    /* address range of the writes lost in failed transfers */
+    bool failed;
+    u16 failed_min;
+    u16 failed_max;
+};
+
+struct ap1302_shadow {
+    u32 val[AP1302_NUM_SHADOW_REGS];
+    /* Bits set through the shadow, the others are preserved on flush */
+    u32 mask[AP1302_NUM_SHADOW_REGS];
+    DECLARE_BITMAP(valid, AP1302_NUM_SHADOW_REGS);
+    DECLARE_BITMAP(dirty, AP1302_NUM_SHADOW_REGS);
+};
+
 /*
- * Image size under 1280 * 960 are SUBSAMPLING
- * Image size upper 1280 * 960 are SCALING
+ * Image size up to 1280 * 960 are SUBSAMPLING
+ * Image size above 1280 * 960 are SCALING
  */
 enum ap1302_downsize_mode {
     SUBSAMPLING,
     SCALING,
 };
 
-struct reg_value {
-    u32 reg_addr;
-    u32 val;
-    u32 mask;
-    u32 delay_ms;
+/*
+ * Register scripts
+ *
+ * A script is an array of 32-bit words. Each instruction starts with a word
+ * holding the opcode in the top 4 bits and an argument in the lower 28 bits,
+ * followed by its operands:
+ *
+ * - WRITE reg, val: write val to reg
+ * - UPDATE reg, mask, val: update the mask bits of reg to val
+ * - BULK reg, count, val...: write count values to consecutive registers
+ *   starting at reg
+ * - POLL reg, mask, val, timeout_us: wait until the mask bits of reg read back
+ *   as val
+ * - DELAY us: sleep for the given time
+ * - READ reg: read reg, the values are returned to the caller in order
+ *
+ * Registers are encoded with AP1302_REG_16BIT() or AP1302_REG_32BIT() and can
+ * address the advanced registers.
+ */
+#define AP1302_SCRIPT_OP_WRITE          0
+#define AP1302_SCRIPT_OP_UPDATE         1
+#define AP1302_SCRIPT_OP_BULK           2
+#define AP1302_SCRIPT_OP_POLL           3
+#define AP1302_SCRIPT_OP_DELAY          4
+#define AP1302_SCRIPT_OP_READ           5
+
+#define AP1302_SCRIPT_OP(op, arg)       (((op) << 28) | (arg))
+#define AP1302_SCRIPT_OPCODE(w)         ((w) >> 28)
+#define AP1302_SCRIPT_ARG(w)            ((w) & 0x0fffffff)
+
+#define AP1302_SCRIPT_WRITE(reg, val)                                   \
+    AP1302_SCRIPT_OP(AP1302_SCRIPT_OP_WRITE, reg), (val)
+#define AP1302_SCRIPT_UPDATE(reg, mask, val)                            \
+    AP1302_SCRIPT_OP(AP1302_SCRIPT_OP_UPDATE, reg), (mask), (val)
+#define AP1302_SCRIPT_BULK(reg, ...)                                    \
+    AP1302_SCRIPT_OP(AP1302_SCRIPT_OP_BULK, reg),                       \
+    sizeof((u32[]){ __VA_ARGS__ }) / sizeof(u32), __VA_ARGS__
+#define AP1302_SCRIPT_POLL(reg, mask, val, timeout_us)                  \
+    AP1302_SCRIPT_OP(AP1302_SCRIPT_OP_POLL, reg), (mask), (val), (timeout_us)
+#define AP1302_SCRIPT_DELAY(us)                                         \
+    AP1302_SCRIPT_OP(AP1302_SCRIPT_OP_DELAY, us)
+#define AP1302_SCRIPT_READ(reg)                                         \
+    AP1302_SCRIPT_OP(AP1302_SCRIPT_OP_READ, reg)
+
+/* Operand words following each opcode, BULK adds the values. */
+static const u8 ap1302_script_operands[] = {
+    [AP1302_SCRIPT_OP_WRITE] = 1,
+    [AP1302_SCRIPT_OP_UPDATE] = 2,
+    [AP1302_SCRIPT_OP_BULK] = 1,
+    [AP1302_SCRIPT_OP_POLL] = 3,
+    [AP1302_SCRIPT_OP_DELAY] = 0,
+    [AP1302_SCRIPT_OP_READ] = 0,
+};
+
+struct ap1302_script {
+    const u32 *data;
+    unsigned int len; /* in words */
+};
+
+#define AP1302_SCRIPT(table)    { table, ARRAY_SIZE(table) }
+
+/*
+ * Scripts can be overridden by firmware files named ap1302_script_init.bin
+ * and ap1302_script_<width>x<height>.bin, made of a header followed by the
+ * script words, all in little endian.
+ */
+#define AP1302_SCRIPT_MAGIC             0x53323041 /* "A02S" */
+
+struct ap1302_script_header {
+    __le32 magic;
+    __le32 len; /* in words */
+} __packed;
+
+#define AP1302_SCRIPT_INIT              AP1302_NUM_MODES
+#define AP1302_NUM_SCRIPTS              (AP1302_NUM_MODES + 1)
+
+/*
+ * Register batch submitted through debugfs, see ap1302_batch_parse(). The
+ * batch is run when submitted, and optionally replayed at stream on.
+ */
+#define AP1302_BATCH_MAX_SIZE           16384
+/* Delays and poll timeouts of a batch, which runs under the sensor lock */
+#define AP1302_BATCH_MAX_WAIT_US        500000
+
+struct ap1302_batch {
+    struct ap1302_script script;
+    u32 *reads;
+    unsigned int num_reads;
+    bool run;
+    int ret;
+    bool replay;
 };
 
 struct ap1302_mode_info {
@@ -461,14 +754,26 @@ struct ap1302_mode_info {
     u32 htot;
     u32 vact;
     u32 vtot;
-    const struct reg_value *reg_data;
-    u32 reg_data_size;
+    struct ap1302_script script;
     u32 max_fps;
 };
 
+/* Output configuration of one of the contexts */
+struct ap1302_context {
+    struct v4l2_mbus_framefmt fmt;
+    struct ap1302_mode_info mode;
+    struct v4l2_fract frame_interval;
+    struct v4l2_rect roi; /* within the output size, 0 if unset */
+    bool pending_fmt_change;
+    bool pending_mode_change;
+};
+
 struct ap1302_ctrls {
     struct v4l2_ctrl_handler handler;
     struct v4l2_ctrl *pixel_rate;
+    struct v4l2_ctrl *hblank;
+    struct v4l2_ctrl *vblank;
+    struct v4l2_ctrl *context;
     struct {
         struct v4l2_ctrl *auto_exp;
         struct v4l2_ctrl *exposure;
@@ -498,38 +803,64 @@ struct ap1302_dev {
     struct v4l2_subdev sd;
     struct media_pad pad;
     struct v4l2_fwnode_endpoint ep; /* the parsed DT endpoint info */
+    u64 link_freq; /* from the endpoint link-frequencies */
     struct clk *xclk; /* system clock to AP1302 */
     u32 xclk_freq;
-    struct regmap *regmap16;
-    struct regmap *regmap32;
+    struct regmap *regmap;
+    struct ap1302_xfer xfer;
     u32 reg_page;
+    u32 page_switches;
 
+    struct ap1302_fw_cache_entry *fw_entry;
     const struct firmware *fw;
+    struct ap1302_firmware_header fw_hdr;
+    u32 fw_size; /* bootdata size, excluding the header */
+    unsigned int fw_burst_len;
     const char *model;
     struct regulator_bulk_data supplies[AP1302_NUM_SUPPLIES];
     struct gpio_desc *reset_gpio;
     struct gpio_desc *pwdn_gpio;
     bool   upside_down;
+    bool   standby;
+    bool   spi_boot;
 
     /* lock to protect all members below */
     struct mutex lock;
 
     int power_count;
 
-    struct v4l2_mbus_framefmt fmt;
-    bool pending_fmt_change;
-
-    const struct ap1302_mode_info *current_mode;
-    const struct ap1302_mode_info *last_mode;
-    enum ap1302_frame_rate current_fr;
-    struct v4l2_fract frame_interval;
+    /* all contexts are programmed, the selected one is output and configured */
+    struct ap1302_context contexts[AP1302_NUM_CONTEXTS];
+    struct ap1302_context *ctx;
+    enum ap1302_downsize_mode last_dn_mode;
 
     struct ap1302_ctrls ctrls;
     u32 prev_sysclk, prev_hts;
     u32 ae_low, ae_high, ae_target;
 
-    bool pending_mode_change;
     bool streaming;
+
+    /* shadow of the configuration registers, flushed at stream on */
+    struct ap1302_shadow shadow;
+    bool atomic; /* atomic transaction in progress */
+    bool sync_ctrls; /* controls updated from the context, not by the user */
+
+    /* register scripts loaded from firmware files, override the built-ins */
+    struct ap1302_script scripts[AP1302_NUM_SCRIPTS];
+    struct ap1302_batch batch;
+
+    /* last and longest observed readiness wait times, in us */
+    unsigned int wait_us[AP1302_NUM_WAITS];
+    unsigned int wait_max_us[AP1302_NUM_WAITS];
+
+    /* asynchronous boot */
+    struct work_struct boot_work;
+    struct completion boot_done;
+    int boot_ret;
+
+    struct ap1302_boot_stats boot_stats;
+    struct ap1302_stats stats;
+    struct dentry *debugfs;
 };
 
 
@@ -544,47 +875,47 @@ static inline struct v4l2_subdev *ctrl_to_sd(struct v4l2_ctrl *ctrl)
                  ctrls.handler)->sd;
 }
 
-static const struct reg_value ap1302_init_setting_30fps_VGA[] = {
+static const u32 ap1302_script_init[] = {
 
 };
 
-static const struct reg_value ap1302_setting_VGA_640_480[] = {
+static const u32 ap1302_setting_VGA_640_480[] = {
 
 };
 
-static const struct reg_value ap1302_setting_QVGA_320_240[] = {
+static const u32 ap1302_setting_QVGA_320_240[] = {
 
 };
 
-static const struct reg_value ap1302_setting_QCIF_176_144[] = {
+static const u32 ap1302_setting_QCIF_176_144[] = {
 
 };
 
-static const struct reg_value ap1302_setting_NTSC_720_480[] = {
+static const u32 ap1302_setting_NTSC_720_480[] = {
 
 };
 
-static const struct reg_value ap1302_setting_PAL_720_576[] = {
+static const u32 ap1302_setting_PAL_720_576[] = {
 
 };
 
-static const struct reg_value ap1302_setting_XGA_1024_768[] = {
+static const u32 ap1302_setting_XGA_1024_768[] = {
 
 };
 
-static const struct reg_value ap1302_setting_720P_1280_720[] = {
+static const u32 ap1302_setting_720P_1280_720[] = {
 
 };
 
-static const struct reg_value ap1302_setting_1080P_1920_1080[] = {
+static const u32 ap1302_setting_1080P_1920_1080[] = {
 
 };
 
-static const struct reg_value ap1302_setting_QSXGA_2592_1944[] = {
+static const u32 ap1302_setting_QSXGA_2592_1944[] = {
 
 };
 
-static const struct reg_value ap1302_setting_4K_3840_2160[] = {
+static const u32 ap1302_setting_4K_3840_2160[] = {
 
 };
 
@@ -592,63 +923,52 @@ static const struct reg_value ap1302_setting_4K_3840_2160[] = {
 static const struct ap1302_mode_info ap1302_mode_init_data = {
     AP1302_MODE_4K_3840_2160, SCALING,
     3840, 3840, 2160, 2160,
-    ap1302_setting_4K_3840_2160,
-    ARRAY_SIZE(ap1302_setting_4K_3840_2160),
-    AP1302_30_FPS
+    AP1302_SCRIPT(ap1302_script_init),
+    AP1302_DEFAULT_FPS
 };
 
 static const struct ap1302_mode_info
 ap1302_mode_data[AP1302_NUM_MODES] = {
     {AP1302_MODE_QCIF_176_144, SUBSAMPLING,
      176, 1896, 144, 984,
-     ap1302_setting_QCIF_176_144,
-     ARRAY_SIZE(ap1302_setting_QCIF_176_144),
-     AP1302_30_FPS},
+     AP1302_SCRIPT(ap1302_setting_QCIF_176_144),
+     AP1302_DEFAULT_FPS},
     {AP1302_MODE_QVGA_320_240, SUBSAMPLING,
      320, 1896, 240, 984,
-     ap1302_setting_QVGA_320_240,
-     ARRAY_SIZE(ap1302_setting_QVGA_320_240),
-     AP1302_30_FPS},
+     AP1302_SCRIPT(ap1302_setting_QVGA_320_240),
+     AP1302_DEFAULT_FPS},
     {AP1302_MODE_VGA_640_480, SUBSAMPLING,
      640, 1896, 480, 1080,
-     ap1302_setting_VGA_640_480,
-     ARRAY_SIZE(ap1302_setting_VGA_640_480),
-     AP1302_30_FPS},
+     AP1302_SCRIPT(ap1302_setting_VGA_640_480),
+     AP1302_DEFAULT_FPS},
     {AP1302_MODE_NTSC_720_480, SUBSAMPLING,
      720, 1896, 480, 984,
-     ap1302_setting_NTSC_720_480,
-     ARRAY_SIZE(ap1302_setting_NTSC_720_480),
-     AP1302_30_FPS},
+     AP1302_SCRIPT(ap1302_setting_NTSC_720_480),
+     AP1302_DEFAULT_FPS},
     {AP1302_MODE_PAL_720_576, SUBSAMPLING,
      720, 1896, 576, 984,
-     ap1302_setting_PAL_720_576,
-     ARRAY_SIZE(ap1302_setting_PAL_720_576),
-     AP1302_30_FPS},
+     AP1302_SCRIPT(ap1302_setting_PAL_720_576),
+     AP1302_DEFAULT_FPS},
     {AP1302_MODE_XGA_1024_768, SUBSAMPLING,
      1024, 1896, 768, 1080,
-     ap1302_setting_XGA_1024_768,
-     ARRAY_SIZE(ap1302_setting_XGA_1024_768),
-     AP1302_30_FPS},
+     AP1302_SCRIPT(ap1302_setting_XGA_1024_768),
+     AP1302_DEFAULT_FPS},
     {AP1302_MODE_720P_1280_720, SUBSAMPLING,
      1280, 1892, 720, 740,
-     ap1302_setting_720P_1280_720,
-     ARRAY_SIZE(ap1302_setting_720P_1280_720),
-     AP1302_30_FPS},
+     AP1302_SCRIPT(ap1302_setting_720P_1280_720),
+     AP1302_DEFAULT_FPS},
     {AP1302_MODE_1080P_1920_1080, SCALING,
      1920, 2500, 1080, 1120,
-     ap1302_setting_1080P_1920_1080,
-     ARRAY_SIZE(ap1302_setting_1080P_1920_1080),
-     AP1302_30_FPS},
+     AP1302_SCRIPT(ap1302_setting_1080P_1920_1080),
+     AP1302_DEFAULT_FPS},
     {AP1302_MODE_QSXGA_2592_1944, SCALING,
      2592, 2844, 1944, 1968,
-     ap1302_setting_QSXGA_2592_1944,
-     ARRAY_SIZE(ap1302_setting_QSXGA_2592_1944),
-     AP1302_30_FPS},
+     AP1302_SCRIPT(ap1302_setting_QSXGA_2592_1944),
+     AP1302_DEFAULT_FPS},
     {AP1302_MODE_4K_3840_2160, SCALING,
      3840, 3840, 2160, 2160,
-     ap1302_setting_4K_3840_2160,
-     ARRAY_SIZE(ap1302_setting_4K_3840_2160),
-     AP1302_30_FPS},
+     AP1302_SCRIPT(ap1302_setting_4K_3840_2160),
+     AP1302_DEFAULT_FPS},
 };
 
 static int ap1302_init_slave_id(struct ap1302_dev *sensor)
@@ -659,1543 +979,4531 @@ static int ap1302_init_slave_id(struct ap1302_dev *sensor)
 
 /* -----------------------------------------------------------------------------
  * Register Configuration
+ *
+ * All registers are accessed through a single regmap. Register numbers are the
+ * size-encoded AP1302_REG_16BIT() and AP1302_REG_32BIT() values, the regmap bus
+ * below formats each access with the right width. Writes can be queued to be
+ * sent as one multi-message I2C transfer, see ap1302_xfer_begin().
  */
-static const struct regmap_config ap1302_reg16_config = {
-    .reg_bits = 16,
-    .val_bits = 16,
-    .reg_stride = 2,
-    .reg_format_endian = REGMAP_ENDIAN_BIG,
-    .val_format_endian = REGMAP_ENDIAN_BIG,
-    .cache_type = REGCACHE_NONE,
-};
 
-static const struct regmap_config ap1302_reg32_config = {
-    .reg_bits = 16,
-    .val_bits = 32,
-    .reg_stride = 4,
-    .reg_format_endian = REGMAP_ENDIAN_BIG,
-    .val_format_endian = REGMAP_ENDIAN_BIG,
-    .cache_type = REGCACHE_NONE,
+/*
+ * Registers updated by the AP1302 itself, or whose access has side effects.
+ * Everything else holds configuration written by the driver and is cached.
+ * The advanced registers window is volatile as it is paged.
+ */
+static const struct regmap_range ap1302_volatile_ranges[] = {
+    regmap_reg_range(0x0000, 0x0016), /* CHIP_VERSION .. SIPM_ERR_1 */
+    regmap_reg_range(0x0a2c, 0x0a2c + AP1302_CON_BUF_SIZE - 1), /* CON_BUF */
+    regmap_reg_range(0x1184, 0x1184), /* ATOMIC */
+    regmap_reg_range(0x6002, 0x600a), /* BOOTDATA_STAGE, WARNING */
+    regmap_reg_range(0x601a, 0x601a), /* SYS_START */
+    regmap_reg_range(0x60a0, 0x60ac), /* DMA */
+    regmap_reg_range(0x6134, 0x6134), /* SIP_CHECKSUM */
+    regmap_reg_range(0x8000, 0x9fff), /* bootdata load window */
+    regmap_reg_range(AP1302_REG_ADV_START, AP1302_REG_ADV_END), /* advanced registers */
+    regmap_reg_range(0xf038, 0xf038), /* ADVANCED_BASE */
+    regmap_reg_range(0xf052, 0xf052), /* SIP_CRC */
 };
 
-static int __ap1302_write(struct ap1302_dev *ap1302, u32 reg, u32 val)
+static bool ap1302_volatile_reg(struct device *dev, unsigned int reg)
 {
-    unsigned int size = AP1302_REG_SIZE(reg);
-    u16 addr = AP1302_REG_ADDR(reg);
-    int ret;
+    return regmap_reg_in_ranges(AP1302_REG_ADDR(reg), ap1302_volatile_ranges,
+                                ARRAY_SIZE(ap1302_volatile_ranges));
+}
 
-    switch (size) {
-    case 2:
-        ret = regmap_write(ap1302->regmap16, addr, val);
-        break;
-    case 4:
-        ret = regmap_write(ap1302->regmap32, addr, val);
-        break;
-    default:
-        return -EINVAL;
-    }
+static int ap1302_i2c_transfer(struct ap1302_dev *sensor,
+                               struct i2c_msg *msgs, unsigned int num)
+{
+    int ret;
 
-    if (ret) {
-        dev_err(ap1302->dev, "%s: register 0x%04x %s failed: %d\n",
-                __func__, addr, "write", ret);
+    ret = i2c_transfer(sensor->i2c_client->adapter, msgs, num);
+    if (ret < 0)
         return ret;
-    }
 
-    return 0;
+    return ret == num ? 0 : -EIO;
 }
 
-static int ap1302_write(struct ap1302_dev *ap1302, u32 reg, u32 val,
-            int *err)
+/*
+ * Flush the queued transfer. The queue stays active, the values of the queued
+ * reads are available on return.
+ */
+static int ap1302_xfer_flush(struct ap1302_dev *sensor)
 {
-    u32 page = AP1302_REG_PAGE(reg);
-    int ret;
+    struct ap1302_xfer *xfer = &sensor->xfer;
+    unsigned int i;
+    int ret = 0;
 
-    if (err && *err)
-        return *err;
+    if (!xfer->num_msgs)
+        return 0;
 
-    if (page) {
-        if (ap1302->reg_page != page) {
-            ret = __ap1302_write(ap1302, AP1302_ADVANCED_BASE, page);
-            if (ret < 0)
-                goto done;
+    ret = ap1302_i2c_transfer(sensor, xfer->msgs, xfer->num_msgs);
+    if (!ret) {
+        for (i = 0; i < xfer->num_reads; ++i) {
+            struct ap1302_queued_read *rd = &xfer->reads[i];
 
-            ap1302->reg_page = page;
+            *rd->val = rd->size == 2 ? get_unaligned_be16(rd->data)
+                     : get_unaligned_be32(rd->data);
         }
+    } else {
+        dev_err(sensor->dev, "%s: %u messages transfer failed: %d\n",
+                __func__, xfer->num_msgs, ret);
 
-        reg &= ~AP1302_REG_PAGE_MASK;
-        reg += AP1302_REG_ADV_START;
+        /*
+         * The regmap has cached the queued writes, record their range to
+         * drop it from the cache on commit, as the regmap lock may be held
+         * here.
+         */
+        for (i = 0; i < xfer->num_msgs; ++i) {
+            struct i2c_msg *msg = &xfer->msgs[i];
+            u16 addr;
+
+            if (msg->flags & I2C_M_RD || msg->len <= 2)
+                continue;
+
+            addr = get_unaligned_be16(msg->buf);
+            if (!xfer->failed) {
+                xfer->failed = true;
+                xfer->failed_min = addr;
+                xfer->failed_max = addr + msg->len - 3;
+            } else {
+                xfer->failed_min = min_t(u16, xfer->failed_min, addr);
+                xfer->failed_max = max_t(u16, xfer->failed_max,
+                                         addr + msg->len - 3);
+            }
+        }
     }
 
-    ret = __ap1302_write(ap1302, reg, val);
-
-done:
-    if (err && ret)
-        *err = ret;
+    xfer->transfers++;
+    xfer->num_msgs = 0;
+    xfer->num_reads = 0;
+    xfer->buf_len = 0;
+    xfer->last_reg = 0;
 
     return ret;
 }
 
-static int __ap1302_read(struct ap1302_dev *ap1302, u32 reg, u32 *val)
+/*
+ * Make room for @msgs messages and @len bytes in the transfer queue. A read
+ * takes two messages and is always queued, even if the adapter limits the
+ * transfers to a single message, as it then supports write-then-read.
+ */
+static int ap1302_xfer_reserve(struct ap1302_dev *sensor, unsigned int msgs,
+                               unsigned int len)
 {
-    unsigned int size = AP1302_REG_SIZE(reg);
-    u16 addr = AP1302_REG_ADDR(reg);
-    int ret;
-
-    switch (size) {
-    case 2:
-        ret = regmap_read(ap1302->regmap16, addr, val);
-        break;
-    case 4:
-        ret = regmap_read(ap1302->regmap32, addr, val);
-        break;
-    default:
-        return -EINVAL;
-    }
+    struct ap1302_xfer *xfer = &sensor->xfer;
 
-    if (ret) {
-        dev_err(ap1302->dev, "%s: register 0x%04x %s failed: %d\n",
-                __func__, addr, "read", ret);
-                return ret;
-    }
-    
-    dev_dbg(ap1302->dev, "%s: R0x%04x = 0x%0*x\n", __func__,
-            addr, size * 2, *val);
+    if (xfer->num_msgs + msgs <= xfer->max_msgs &&
+        xfer->buf_len + len <= sizeof(xfer->buf))
+        return 0;
 
-    return 0;
+    return ap1302_xfer_flush(sensor);
 }
 
-static int ap1302_read(struct ap1302_dev *ap1302, u32 reg, u32 *val)
+/*
+ * Queue a register write. A write to the register following the previously
+ * queued write, with the same width, is appended to the same message and uses
+ * the AP1302 address auto-increment.
+ */
+static int ap1302_xfer_write(struct ap1302_dev *sensor, u32 reg, u32 val)
 {
-    u32 page = AP1302_REG_PAGE(reg);
+    struct ap1302_xfer *xfer = &sensor->xfer;
+    unsigned int size = AP1302_REG_SIZE(reg);
+    struct i2c_msg *msg;
+    u8 *data;
     int ret;
 
-    if (page) {
-        if (ap1302->reg_page != page) {
-            ret = __ap1302_write(ap1302, AP1302_ADVANCED_BASE, page);
-            if (ret < 0)
-                return ret;
-
-            ap1302->reg_page = page;
-        }
-
-        reg &= ~AP1302_REG_PAGE_MASK;
-        reg += AP1302_REG_ADV_START;
-    }
+    msg = xfer->num_msgs ? &xfer->msgs[xfer->num_msgs - 1] : NULL;
 
-    return __ap1302_read(ap1302, reg, val);
-}
+    if (msg && xfer->last_reg && AP1302_REG_SIZE(xfer->last_reg) == size &&
+        AP1302_REG_ADDR(reg) == AP1302_REG_ADDR(xfer->last_reg) + size &&
+        msg->len + size <= xfer->max_write_len &&
+        xfer->buf_len + size <= sizeof(xfer->buf)) {
+        data = &xfer->buf[xfer->buf_len];
+        msg->len += size;
+        xfer->buf_len += size;
+    } else {
+        ret = ap1302_xfer_reserve(sensor, 1, 2 + size);
+        if (ret)
+            return ret;
 
-static int ap1302_write_reg16(struct ap1302_dev *sensor, u16 reg, u16 val)
-{
-	struct i2c_client *client = sensor->i2c_client;
-	struct i2c_msg msg;
-	u8 buf[4];
-	int ret;
+        msg = &xfer->msgs[xfer->num_msgs++];
+        msg->addr = sensor->i2c_client->addr;
+        msg->flags = 0;
+        msg->buf = &xfer->buf[xfer->buf_len];
+        msg->len = 2 + size;
+        xfer->buf_len += 2 + size;
 
-	buf[0] = reg >> 8;
-	buf[1] = reg & 0xff;
-	buf[2] = val >> 8;
-	buf[3] = val & 0xff;
+        put_unaligned_be16(AP1302_REG_ADDR(reg), msg->buf);
+        data = msg->buf + 2;
+    }
 
-	msg.addr = client->addr;
-	msg.flags = client->flags;
-	msg.buf = buf;
-	msg.len = sizeof(buf);
+    if (size == 2)
+        put_unaligned_be16(val, data);
+    else
+        put_unaligned_be32(val, data);
 
-	ret = i2c_transfer(client->adapter, &msg, 1);
-	if (ret < 0) {
-		dev_err(&client->dev, "%s: error: reg=%x, val=%x\n",
-			__func__, reg, val);
-		return ret;
-	}
+    xfer->last_reg = reg;
 
-	return 0;
+    return 0;
 }
 
-static int ap1302_read_reg16(struct ap1302_dev *sensor, u16 reg, u16 *val)
+/*
+ * Queue a read of a volatile register. @val is filled when the queue is
+ * flushed. Cached registers must be read with ap1302_read().
+ */
+static int ap1302_xfer_read(struct ap1302_dev *sensor, u32 reg, u32 *val)
 {
-	struct i2c_client *client = sensor->i2c_client;
-	struct i2c_msg msg[2];
-	u8 buf[2];
-	int ret;
+    struct ap1302_xfer *xfer = &sensor->xfer;
+    unsigned int size = AP1302_REG_SIZE(reg);
+    struct ap1302_queued_read *rd;
+    struct i2c_msg *msg;
+    int ret;
 
-	buf[0] = reg >> 8;
-	buf[1] = reg & 0xff;
+    ret = ap1302_xfer_reserve(sensor, 2, 2 + size);
+    if (ret)
+        return ret;
 
-	msg[0].addr = client->addr;
-	msg[0].flags = client->flags;
-	msg[0].buf = buf;
-	msg[0].len = sizeof(buf);
+    msg = &xfer->msgs[xfer->num_msgs];
+    msg[0].addr = sensor->i2c_client->addr;
+    msg[0].flags = 0;
+    msg[0].buf = &xfer->buf[xfer->buf_len];
+    msg[0].len = 2;
+    put_unaligned_be16(AP1302_REG_ADDR(reg), msg[0].buf);
 
-	msg[1].addr = client->addr;
-	msg[1].flags = client->flags | I2C_M_RD;
-	msg[1].buf = buf;
-	msg[1].len = sizeof(buf);
+    msg[1].addr = sensor->i2c_client->addr;
+    msg[1].flags = I2C_M_RD;
+    msg[1].buf = msg[0].buf + 2;
+    msg[1].len = size;
 
-	ret = i2c_transfer(client->adapter, msg, 2);
-	if (ret < 0) {
-		dev_err(&client->dev, "%s: error: reg=%x\n",
-			__func__, reg);
-		return ret;
-	}
+    rd = &xfer->reads[xfer->num_reads++];
+    rd->val = val;
+    rd->data = msg[1].buf;
+    rd->size = size;
 
-	*val = (u16)buf[0] << 8 | buf[1];
-	return 0;
-}
+    xfer->num_msgs += 2;
+    xfer->buf_len += 2 + size;
+    xfer->last_reg = 0;
 
+    return 0;
+}
 
-static int ap1302_check_valid_mode(struct ap1302_dev *sensor,
-                   const struct ap1302_mode_info *mode,
-                   enum ap1302_frame_rate rate)
+/*
+ * Start queuing register accesses. Until ap1302_xfer_commit(), writes are
+ * queued, including writes through the regmap, and sent together as a single
+ * multi-message I2C transfer. Reads through the regmap flush the queue first
+ * to preserve ordering.
+ */
+static void ap1302_xfer_begin(struct ap1302_dev *sensor)
 {
-    int ret = 0;
-
-    switch (mode->id) {
-    case AP1302_MODE_QCIF_176_144:
-    case AP1302_MODE_QVGA_320_240:
-    case AP1302_MODE_NTSC_720_480:
-    case AP1302_MODE_PAL_720_576 :
-    case AP1302_MODE_XGA_1024_768:
-    case AP1302_MODE_720P_1280_720:
-        if ((rate != AP1302_15_FPS) &&
-            (rate != AP1302_30_FPS))
-            ret = -EINVAL;
-        break;
-    case AP1302_MODE_VGA_640_480:
-        if ((rate != AP1302_15_FPS) &&
-            (rate != AP1302_30_FPS))
-            ret = -EINVAL;
-        break;
-    case AP1302_MODE_1080P_1920_1080:
-        if (sensor->ep.bus_type == V4L2_MBUS_CSI2_DPHY) {
-            if ((rate != AP1302_15_FPS) &&
-                (rate != AP1302_30_FPS))
-                ret = -EINVAL;
-         } else {
-            if ((rate != AP1302_15_FPS))
-                ret = -EINVAL;
-         }
-        break;
-    case AP1302_MODE_QSXGA_2592_1944:
-        if (rate != AP1302_08_FPS)
-            ret = -EINVAL;
-        break;
-    case AP1302_MODE_4K_3840_2160:
-        if (rate != AP1302_30_FPS)
-            ret = -EINVAL;
-        break;
-    default:
-        dev_err(sensor->dev, "Invalid mode (%d)\n", mode->id);
-        ret = -EINVAL;
-    }
-
-    return ret;
+    WARN_ON(sensor->xfer.active);
+    sensor->xfer.active = true;
 }
 
-static int ap1302_load_regs(struct ap1302_dev *sensor,
-                const struct ap1302_mode_info *mode)
+/*
+ * Forget the cached values of the registers in the @min to @max address range.
+ * They are dropped from the regmap cache, and the matching shadow registers
+ * are marked invalid to be written again. Writes to the advanced registers
+ * window can't be traced back to their page, all paged shadow registers are
+ * invalidated then.
+ */
+static void ap1302_cache_invalidate(struct ap1302_dev *sensor, u32 min,
+                                    u32 max)
 {
-    const struct reg_value *regs = mode->reg_data;
     unsigned int i;
-    u32 delay_ms;
-    u32 reg_addr;
-    u32 mask, val;
-    int ret = 0;
 
-    for (i = 0; i < mode->reg_data_size; ++i, ++regs) {
-        delay_ms = regs->delay_ms;
-        reg_addr = regs->reg_addr;
-        val = regs->val;
-        mask = regs->mask;
+    regcache_drop_region(sensor->regmap, AP1302_REG_16BIT(min),
+                         AP1302_REG_16BIT(max));
+    regcache_drop_region(sensor->regmap, AP1302_REG_32BIT(min),
+                         AP1302_REG_32BIT(max));
 
-        ret = ap1302_write(sensor, reg_addr, val, NULL);
-        if (ret)
-            break;
+    for (i = 0; i < AP1302_NUM_SHADOW_REGS; ++i) {
+        u32 reg = ap1302_shadow_regs[i];
+        u32 addr = AP1302_REG_PAGE(reg) ? AP1302_REG_ADV_START
+                 : AP1302_REG_ADDR(reg);
+        u32 end = AP1302_REG_PAGE(reg) ? AP1302_REG_ADV_END
+                : addr + AP1302_REG_SIZE(reg) - 1;
 
-        if (delay_ms)
-            usleep_range(1000 * delay_ms, 1000 * delay_ms + 100);
+        if (addr <= max && end >= min)
+            __clear_bit(i, sensor->shadow.valid);
     }
-    return ret;
 }
 
-static int ap1302_set_stream_dvp(struct ap1302_dev *sensor, bool on)
+/* Forget the register values written by failed transfers. */
+static void ap1302_xfer_invalidate(struct ap1302_dev *sensor)
 {
-    int ret;
-    unsigned int flags = sensor->ep.bus.parallel.flags;
+    struct ap1302_xfer *xfer = &sensor->xfer;
 
-    dev_warn(sensor->dev,"not supported\n");
-    return -EINVAL;
+    if (!xfer->failed)
+        return;
+
+    xfer->failed = false;
+    ap1302_cache_invalidate(sensor, xfer->failed_min, xfer->failed_max);
 }
 
-static int ap1302_set_stream_mipi(struct ap1302_dev *sensor, bool on)
+static int ap1302_xfer_commit(struct ap1302_dev *sensor)
 {
-    int ret = 0;
+    int ret;
 
+    ret = ap1302_xfer_flush(sensor);
+    sensor->xfer.active = false;
 
-    if (on) {
-        ret = 0;
-    } else {
-        ret = 0;
-    }
+    /* The page select write may not have reached the device. */
+    if (ret)
+        sensor->reg_page = AP1302_REG_PAGE_MASK + 1;
+
+    ap1302_xfer_invalidate(sensor);
 
     return ret;
 }
 
-static int ap1302_set_virtual_channel(struct ap1302_dev *sensor)
+static int ap1302_bus_reg_write(void *context, unsigned int reg,
+                                unsigned int val)
 {
-    u8 temp, channel = virtual_channel;
-    int ret;
+    struct ap1302_dev *sensor = context;
+    u8 buf[6];
+    struct i2c_msg msg = {
+        .addr = sensor->i2c_client->addr,
+        .buf = buf,
+        .len = 2 + AP1302_REG_SIZE(reg),
+    };
 
-    if (channel > 3) {
-        dev_err(sensor->dev,
-            "%s: wrong virtual_channel parameter, expected (0..3), got %d\n",
-            __func__, channel);
-        return -EINVAL;
-    }
-    return 0;
-}
+    if (sensor->xfer.active)
+        return ap1302_xfer_write(sensor, reg, val);
 
-static const struct ap1302_mode_info *
-ap1302_find_mode(struct ap1302_dev *sensor, enum ap1302_frame_rate fr,
-         int width, int height, bool nearest)
-{
-    const struct ap1302_mode_info *mode;
-    mode = v4l2_find_nearest_size(ap1302_mode_data,
-                      ARRAY_SIZE(ap1302_mode_data),
-                      hact, vact,
-                      width, height);
+    put_unaligned_be16(AP1302_REG_ADDR(reg), buf);
+    if (AP1302_REG_SIZE(reg) == 2)
+        put_unaligned_be16(val, &buf[2]);
+    else
+        put_unaligned_be32(val, &buf[2]);
 
-    if (!mode ||
-        (!nearest && (mode->hact != width || mode->vact != height))) {
-        return NULL;
-    }
-    return mode;
+    return ap1302_i2c_transfer(sensor, &msg, 1);
 }
 
-static u64 ap1302_calc_pixel_rate(struct ap1302_dev *sensor)
+static int ap1302_bus_reg_read(void *context, unsigned int reg,
+                               unsigned int *val)
 {
-    u64 rate;
+    struct ap1302_dev *sensor = context;
+    u32 value;
+    int ret;
 
-    rate = sensor->current_mode->vtot * sensor->current_mode->htot;
-    rate *= ap1302_framerates[sensor->current_fr];
+    if (sensor->xfer.active) {
+        ret = ap1302_xfer_flush(sensor);
+        if (ret)
+            return ret;
+    }
+
+    ret = ap1302_xfer_read(sensor, reg, &value);
+    if (!ret)
+        ret = ap1302_xfer_flush(sensor);
+    if (ret)
+        return ret;
 
-    return rate;
+    *val = value;
+    return 0;
 }
 
+static const struct regmap_bus ap1302_regmap_bus = {
+    .reg_write = ap1302_bus_reg_write,
+    .reg_read = ap1302_bus_reg_read,
+};
+
+static const struct regmap_config ap1302_reg_config = {
+    .reg_bits = 32,
+    .val_bits = 32,
+    .max_register = AP1302_REG_32BIT(0xfffc),
+    .volatile_reg = ap1302_volatile_reg,
+    .cache_type = REGCACHE_RBTREE,
+};
+
 /*
- * if sensor changes inside scaling or subsampling
- * change mode directly
+ * Write raw data to consecutive registers, for the bootdata window and the
+ * CON_BUF staging buffer. Adapters supporting I2C_M_NOSTART send the payload
+ * in place, others need it copied after the register address.
  */
-static int ap1302_set_mode_direct(struct ap1302_dev *sensor,
-                  const struct ap1302_mode_info *mode)
+static int ap1302_write_raw(struct ap1302_dev *sensor, u16 addr,
+                            const void *data, size_t len)
 {
-    unsigned int data_lanes = sensor->ep.bus.mipi_csi2.num_data_lanes;
-    int ret = 0;
+    struct i2c_client *client = sensor->i2c_client;
+    u8 addr_buf[2];
+    struct i2c_msg msgs[2];
+    u8 *buf;
+    int ret;
 
-    if (!mode->reg_data)
-        return -EINVAL;
+    put_unaligned_be16(addr, addr_buf);
 
-    /* Write capture setting */
-    ap1302_write(sensor, AP1302_PREVIEW_HINF_CTRL,
-                 AP1302_PREVIEW_HINF_CTRL_SPOOF |
-                 AP1302_PREVIEW_HINF_CTRL_MIPI_LANES(data_lanes), &ret);
+    if (i2c_check_functionality(client->adapter, I2C_FUNC_NOSTART)) {
+        msgs[0].addr = client->addr;
+        msgs[0].flags = 0;
+        msgs[0].buf = addr_buf;
+        msgs[0].len = sizeof(addr_buf);
+        msgs[1].addr = client->addr;
+        msgs[1].flags = I2C_M_NOSTART;
+        msgs[1].buf = (u8 *)data;
+        msgs[1].len = len;
+
+        return ap1302_i2c_transfer(sensor, msgs, 2);
+    }
+
+    buf = kmalloc(len + 2, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    memcpy(buf, addr_buf, 2);
+    memcpy(buf + 2, data, len);
 
-    ap1302_write(sensor, AP1302_PREVIEW_WIDTH,
-                 mode->hact, &ret);
-    ap1302_write(sensor, AP1302_PREVIEW_HEIGHT,
-                 mode->vact, &ret);
+    msgs[0].addr = client->addr;
+    msgs[0].flags = 0;
+    msgs[0].buf = buf;
+    msgs[0].len = len + 2;
+
+    ret = ap1302_i2c_transfer(sensor, msgs, 1);
+    kfree(buf);
 
     return ret;
 }
 
-static int ap1302_set_mode(struct ap1302_dev *sensor)
+static int ap1302_read_raw(struct ap1302_dev *sensor, u16 addr, void *data,
+                           size_t len)
 {
-    const struct ap1302_mode_info *mode = sensor->current_mode;
-    const struct ap1302_mode_info *orig_mode = sensor->last_mode;
-    enum ap1302_downsize_mode dn_mode, orig_dn_mode;
-    bool auto_gain = sensor->ctrls.auto_gain->val == 1;
-    bool auto_exp =  sensor->ctrls.auto_exp->val == V4L2_EXPOSURE_AUTO;
-    unsigned long rate;
-    int ret;
+    struct i2c_client *client = sensor->i2c_client;
+    u8 addr_buf[2];
+    struct i2c_msg msgs[2] = {
+        {
+            .addr = client->addr,
+            .buf = addr_buf,
+            .len = sizeof(addr_buf),
+        }, {
+            .addr = client->addr,
+            .flags = I2C_M_RD,
+            .buf = data,
+            .len = len,
+        },
+    };
 
-    dn_mode = mode->dn_mode;
-    orig_dn_mode = orig_mode->dn_mode;
+    put_unaligned_be16(addr, addr_buf);
 
-    if ((dn_mode == SUBSAMPLING && orig_dn_mode == SCALING) ||
-        (dn_mode == SCALING && orig_dn_mode == SUBSAMPLING)) {
-        /*
-         * change between subsampling and scaling
-         * go through exposure calculation
-         */
-        ret = ap1302_set_mode_direct(sensor, mode);
-    } else {
-        /*
-         * change inside subsampling or scaling
-         * download firmware directly
-         */
-        ret = ap1302_set_mode_direct(sensor, mode);
+    return ap1302_i2c_transfer(sensor, msgs, 2);
+}
+
+/*
+ * Size the transfer queue to the adapter limits. Adapters that only support
+ * combined write-then-read transfers get one write or one read per transfer.
+ */
+static void ap1302_xfer_init(struct ap1302_dev *sensor)
+{
+    const struct i2c_adapter_quirks *quirks =
+        sensor->i2c_client->adapter->quirks;
+    struct ap1302_xfer *xfer = &sensor->xfer;
+
+    xfer->max_msgs = AP1302_XFER_MAX_MSGS;
+    xfer->max_write_len = AP1302_XFER_BUF_SIZE;
+
+    if (!quirks)
+        return;
+
+    if (quirks->flags & I2C_AQ_COMB)
+        xfer->max_msgs = 1;
+    if (quirks->max_num_msgs)
+        xfer->max_msgs = min_t(unsigned int, quirks->max_num_msgs,
+                               xfer->max_msgs);
+    if (quirks->max_write_len)
+        xfer->max_write_len = min_t(unsigned int, quirks->max_write_len,
+                                    xfer->max_write_len);
+}
+
+/*
+ * Account a register access in the statistics. Queued writes are accounted
+ * when queued, their latency doesn't include the bus transfer.
+ */
+static void ap1302_stats_record(struct ap1302_dev *sensor, u32 reg,
+                                bool write, ktime_t start, int ret)
+{
+    struct ap1302_stats *stats = &sensor->stats;
+    struct ap1302_reg_stats *rs;
+    unsigned int bucket;
+    u64 ns;
+
+    if (!IS_ENABLED(CONFIG_DEBUG_FS))
+        return;
+
+    /* Account advanced registers under their paged address. */
+    if (AP1302_REG_ADDR(reg) >= AP1302_REG_ADV_START &&
+        AP1302_REG_ADDR(reg) <= AP1302_REG_ADV_END &&
+        sensor->reg_page <= AP1302_REG_PAGE_MASK)
+        reg = (reg - AP1302_REG_ADV_START) | sensor->reg_page;
+
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    bucket = ns ? min_t(unsigned int, ilog2(ns),
+                        AP1302_STATS_LAT_BUCKETS - 1) : 0;
+
+    mutex_lock(&stats->lock);
+
+    stats->latency[bucket]++;
+
+    rs = xa_load(&stats->regs, reg);
+    if (!rs && stats->num_regs < AP1302_STATS_MAX_REGS) {
+        rs = kzalloc(sizeof(*rs), GFP_KERNEL);
+        if (rs && xa_err(xa_store(&stats->regs, reg, rs, GFP_KERNEL))) {
+            kfree(rs);
+            rs = NULL;
+        }
+        if (rs)
+            stats->num_regs++;
     }
 
-    sensor->pending_mode_change = false;
-    sensor->last_mode = mode;
+    if (!rs) {
+        stats->untracked++;
+        goto unlock;
+    }
 
-    return 0;
-}
+    if (write)
+        rs->writes++;
+    else
+        rs->reads++;
 
-static int ap1302_set_framefmt(struct ap1302_dev *sensor,
-                   struct v4l2_mbus_framefmt *format);
+    if (ret)
+        rs->errors++;
+    else
+        rs->bytes += AP1302_REG_SIZE(reg);
 
-/* restore the last set video mode after chip power-on */
-static int ap1302_restore_mode(struct ap1302_dev *sensor)
+unlock:
+    mutex_unlock(&stats->lock);
+}
+
+static void ap1302_stats_reset(struct ap1302_dev *sensor)
 {
-    int ret;
+    struct ap1302_stats *stats = &sensor->stats;
+    struct ap1302_reg_stats *rs;
+    unsigned long index;
 
-    /* first load the initial register values */
-    ret = ap1302_load_regs(sensor, &ap1302_mode_init_data);
-    if (ret < 0)
-        return ret;
-    sensor->last_mode = &ap1302_mode_init_data;
+    mutex_lock(&stats->lock);
 
-    /* now restore the last capture mode */
-    ret = ap1302_set_mode(sensor);
-    if (ret < 0)
-        return ret;
+    xa_for_each(&stats->regs, index, rs)
+        kfree(rs);
+    xa_destroy(&stats->regs);
 
-    return ap1302_set_framefmt(sensor, &sensor->fmt);
+    stats->num_regs = 0;
+    stats->untracked = 0;
+    memset(stats->latency, 0, sizeof(stats->latency));
+    sensor->page_switches = 0;
+
+    mutex_unlock(&stats->lock);
 }
 
-static int ap1302_power_on(struct ap1302_dev *ap1302)
+/*
+ * Write a register through the cache. Writes to cached registers are skipped
+ * when the value is unchanged, volatile registers are always written.
+ */
+static int __ap1302_write(struct ap1302_dev *ap1302, u32 reg, u32 val)
 {
+    ktime_t start = ktime_get();
     int ret;
 
-    /* 0. RESET was asserted when getting the GPIO. */
+    if (AP1302_REG_SIZE(reg) != 2 && AP1302_REG_SIZE(reg) != 4)
+        return -EINVAL;
 
-    /* 1. Assert STANDBY. */
-    if (ap1302->pwdn_gpio) {
-        gpiod_set_value_cansleep(ap1302->pwdn_gpio, 1);
-        usleep_range(200, 1000);
-    }
+    if (ap1302_volatile_reg(ap1302->dev, reg))
+        ret = regmap_write(ap1302->regmap, reg, val);
+    else
+        ret = regmap_update_bits(ap1302->regmap, reg, ~0U, val);
 
-    /* 2. Power up the regulators. To be implemented. */
+    ap1302_stats_record(ap1302, reg, true, start, ret);
 
-    /* 3. De-assert STANDBY. */
-    if (ap1302->pwdn_gpio) {
-        gpiod_set_value_cansleep(ap1302->pwdn_gpio, 0);
-        usleep_range(200, 1000);
+    if (ret) {
+        dev_err(ap1302->dev, "%s: register 0x%04x %s failed: %d\n",
+                __func__, AP1302_REG_ADDR(reg), "write", ret);
+        return ret;
     }
 
-    /* 5. De-assert RESET. */
-    gpiod_set_value_cansleep(ap1302->reset_gpio, 0);
-
-    /*
-     * 6. Wait for the AP1302 to initialize. The datasheet doesn't specify
-     * how long this takes.
-     */
-    usleep_range(10000, 11000);
-
     return 0;
 }
 
-static void ap1302_power_off(struct ap1302_dev *ap1302)
+/*
+ * Select the page of the advanced registers window. The current page is cached
+ * to skip redundant switches, the switches are counted for diagnostics.
+ */
+static int ap1302_select_page(struct ap1302_dev *ap1302, u32 page)
 {
-    /* 1. Assert RESET. */
-    gpiod_set_value_cansleep(ap1302->reset_gpio, 1);
+    int ret;
 
-    /* 3. Assert STANDBY. */
-    if (ap1302->pwdn_gpio) {
-        gpiod_set_value_cansleep(ap1302->pwdn_gpio, 1);
-        usleep_range(200, 1000);
-    }
+    if (ap1302->reg_page == page)
+        return 0;
 
-    /* 4. Power down the regulators. To be implemented. */
+    ret = __ap1302_write(ap1302, AP1302_ADVANCED_BASE, page);
+    if (ret < 0)
+        return ret;
 
-    /* 5. De-assert STANDBY. */
-    if (ap1302->pwdn_gpio) {
-        usleep_range(200, 1000);
-        gpiod_set_value_cansleep(ap1302->pwdn_gpio, 0);
-    }
+    ap1302->reg_page = page;
+    ap1302->page_switches++;
+
+    return 0;
 }
 
-static int ap1302_set_power_on(struct ap1302_dev *sensor)
+static int ap1302_write(struct ap1302_dev *ap1302, u32 reg, u32 val,
+            int *err)
 {
+    u32 page = AP1302_REG_PAGE(reg);
     int ret;
 
-    ret = clk_prepare_enable(sensor->xclk);
-    if (ret) {
-        dev_err(sensor->dev, "%s: failed to enable clock\n",
-            __func__);
-        return ret;
-    }
+    if (err && *err)
+        return *err;
 
-    ret = regulator_bulk_enable(AP1302_NUM_SUPPLIES,
-                    sensor->supplies);
-    if (ret) {
-        dev_err(sensor->dev, "%s: failed to enable regulators\n",
-            __func__);
-        goto xclk_off;
+    if (page) {
+        ret = ap1302_select_page(ap1302, page);
+        if (ret < 0)
+            goto done;
+
+        reg &= ~AP1302_REG_PAGE_MASK;
+        reg += AP1302_REG_ADV_START;
     }
 
-    ap1302_power_on(sensor);
-    ret = ap1302_init_slave_id(sensor);
-    if (ret)
-        goto power_off;
+    ret = __ap1302_write(ap1302, reg, val);
 
-    return 0;
+done:
+    if (err && ret)
+        *err = ret;
 
-power_off:
-    ap1302_power_off(sensor);
-    regulator_bulk_disable(AP1302_NUM_SUPPLIES, sensor->supplies);
-xclk_off:
-    clk_disable_unprepare(sensor->xclk);
     return ret;
 }
 
-static void ap1302_set_power_off(struct ap1302_dev *sensor)
+static int __ap1302_read(struct ap1302_dev *ap1302, u32 reg, u32 *val)
 {
-    ap1302_power_off(sensor);
-    regulator_bulk_disable(AP1302_NUM_SUPPLIES, sensor->supplies);
-    clk_disable_unprepare(sensor->xclk);
-    sensor->streaming = false;
-}
+    unsigned int size = AP1302_REG_SIZE(reg);
+    u16 addr = AP1302_REG_ADDR(reg);
+    ktime_t start = ktime_get();
+    int ret;
 
-static int ap1302_set_powerdown_exit(struct ap1302_dev *sensor)
-{
-    return 0;
-}
+    if (size != 2 && size != 4)
+        return -EINVAL;
 
-static int ap1302_set_powerdown_enter(struct ap1302_dev *sensor)
-{
+    ret = regmap_read(ap1302->regmap, reg, val);
+
+    ap1302_stats_record(ap1302, reg, false, start, ret);
+
+    if (ret) {
+        dev_err(ap1302->dev, "%s: register 0x%04x %s failed: %d\n",
+                __func__, addr, "read", ret);
+                return ret;
+    }
     
-    sensor->streaming = false;
+    dev_dbg(ap1302->dev, "%s: R0x%04x = 0x%0*x\n", __func__,
+            addr, size * 2, *val);
+
     return 0;
 }
 
-static int ap1302_set_power(struct ap1302_dev *sensor, bool on)
+static int ap1302_read(struct ap1302_dev *ap1302, u32 reg, u32 *val)
 {
-    int ret = 0;
+    u32 page = AP1302_REG_PAGE(reg);
+    int ret;
 
-    if (on) {
-        ret = ap1302_set_powerdown_exit(sensor);
-        if (ret)
+    if (page) {
+        ret = ap1302_select_page(ap1302, page);
+        if (ret < 0)
             return ret;
 
-        ret = ap1302_restore_mode(sensor);
-        if (ret)
-            goto power_off;
-
-        /* We're done here for DVP bus, while CSI-2 needs setup. */
-        if (sensor->ep.bus_type != V4L2_MBUS_CSI2_DPHY)
-            return 0;
-        usleep_range(500, 1000);
-
-    } else {
-        ret = ap1302_set_powerdown_enter(sensor);
+        reg &= ~AP1302_REG_PAGE_MASK;
+        reg += AP1302_REG_ADV_START;
     }
 
-    return 0;
-
-power_off:
-    ap1302_set_powerdown_enter(sensor);
-    return ret;
+    return __ap1302_read(ap1302, reg, val);
 }
 
+struct ap1302_reg_op {
+    u32 reg;
+    u32 val; /* value to write, or value read */
+    bool write;
+};
 
-/* --------------- Subdev Operations --------------- */
-
-static int ap1302_s_power(struct v4l2_subdev *sd, int on)
+/*
+ * ap1302_reg_batch() - Perform a batch of independent register accesses
+ * @ops: Register reads and writes
+ * @count: Number of entries in @ops
+ *
+ * The accesses are grouped by advanced register page, starting with the
+ * current page, to switch pages once per page instead of once per register.
+ * Accesses within a page, and non-advanced registers, keep their relative
+ * order. Accesses to volatile registers are sent in as few I2C transfers as
+ * the adapter allows. The batch stops at the first error.
+ */
+static int ap1302_reg_batch(struct ap1302_dev *sensor,
+                            struct ap1302_reg_op *ops, unsigned int count)
 {
-    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    unsigned long *done;
+    unsigned int remaining = count;
+    u32 page = sensor->reg_page;
+    unsigned int i;
     int ret = 0;
+    int err;
 
-    mutex_lock(&sensor->lock);
+    done = bitmap_zalloc(count, GFP_KERNEL);
+    if (!done)
+        return -ENOMEM;
 
-    /*
-     * If the power count is modified from 0 to != 0 or from != 0 to 0,
-     * update the power state.
-     */
-    if (sensor->power_count == !on) {
-        ret = ap1302_set_power(sensor, !!on);
-        if (ret)
-            goto out;
-    }
+    ap1302_xfer_begin(sensor);
 
-    /* Update the power count. */
-    sensor->power_count += on ? 1 : -1;
-    WARN_ON(sensor->power_count < 0);
-out:
-    mutex_unlock(&sensor->lock);
+    while (remaining) {
+        u32 next = page;
 
-    if (on && !ret && sensor->power_count == 1) {
-        /* restore controls */
-        
-        ret = v4l2_ctrl_handler_setup(&sensor->ctrls.handler);
+        for_each_clear_bit(i, done, count) {
+            struct ap1302_reg_op *op = &ops[i];
+            u32 op_page = AP1302_REG_PAGE(op->reg);
+
+            if (op_page && op_page != page) {
+                if (next == page)
+                    next = op_page;
+                continue;
+            }
+
+            if (op->write) {
+                ret = ap1302_write(sensor, op->reg, op->val, NULL);
+            } else if (op_page) {
+                ret = ap1302_select_page(sensor, op_page);
+                if (!ret)
+                    ret = ap1302_xfer_read(sensor,
+                                           (op->reg & ~AP1302_REG_PAGE_MASK) +
+                                           AP1302_REG_ADV_START, &op->val);
+            } else if (ap1302_volatile_reg(sensor->dev, op->reg)) {
+                ret = ap1302_xfer_read(sensor, op->reg, &op->val);
+            } else {
+                ret = ap1302_read(sensor, op->reg, &op->val);
+            }
+            if (ret)
+                goto done;
+
+            __set_bit(i, done);
+            remaining--;
+        }
+
+        page = next;
     }
 
-    return ret;
+done:
+    err = ap1302_xfer_commit(sensor);
+    bitmap_free(done);
+    return ret ? ret : err;
 }
 
-static int ap1302_try_frame_interval(struct ap1302_dev *sensor,
-                     struct v4l2_fract *fi,
-                     u32 width, u32 height)
+/*
+ * Update the bits selected by @mask of a shadowed configuration register. The
+ * hardware is only written by ap1302_shadow_flush(), which preserves the bits
+ * never set through the shadow. Errors are accumulated in @err like
+ * ap1302_write().
+ */
+static int ap1302_shadow_update(struct ap1302_dev *sensor, u32 reg, u32 mask,
+                                u32 val, int *err)
 {
-    const struct ap1302_mode_info *mode;
-    enum ap1302_frame_rate rate = AP1302_08_FPS;
-    int minfps, maxfps, best_fps, fps;
-    int i;
+    struct ap1302_shadow *shadow = &sensor->shadow;
+    unsigned int i;
 
-    minfps = ap1302_framerates[AP1302_08_FPS];
-    maxfps = ap1302_framerates[AP1302_60_FPS];
+    if (err && *err)
+        return *err;
 
-    if (fi->numerator == 0) {
-        fi->denominator = maxfps;
-        fi->numerator = 1;
-        rate = AP1302_60_FPS;
-        goto find_mode;
+    for (i = 0; i < AP1302_NUM_SHADOW_REGS; ++i) {
+        if (ap1302_shadow_regs[i] == reg)
+            break;
     }
 
-    fps = clamp_val(DIV_ROUND_CLOSEST(fi->denominator, fi->numerator),
-            minfps, maxfps);
+    if (WARN_ON(i == AP1302_NUM_SHADOW_REGS)) {
+        if (err)
+            *err = -EINVAL;
+        return -EINVAL;
+    }
 
-    best_fps = minfps;
-    for (i = 0; i < ARRAY_SIZE(ap1302_framerates); i++) {
-        int curr_fps = ap1302_framerates[i];
+    if (!test_bit(i, shadow->valid))
+        shadow->mask[i] = 0;
 
-        if (abs(curr_fps - fps) < abs(best_fps - fps)) {
-            best_fps = curr_fps;
-            rate = i;
-        }
-    }
+    val = (shadow->val[i] & ~mask) | (val & mask);
 
-    fi->numerator = 1;
-    fi->denominator = best_fps;
+    if (test_bit(i, shadow->valid) && (shadow->mask[i] & mask) == mask &&
+        shadow->val[i] == val)
+        return 0;
 
-find_mode:
-    mode = ap1302_find_mode(sensor, rate, width, height, false);
-    return mode ? rate : -EINVAL;
-}
+    shadow->val[i] = val;
+    shadow->mask[i] |= mask;
+    __set_bit(i, shadow->valid);
+    __set_bit(i, shadow->dirty);
 
-static int ap1302_get_fmt(struct v4l2_subdev *sd,
-              struct v4l2_subdev_state *sd_state,
-              struct v4l2_subdev_format *format)
-{
-    struct ap1302_dev *sensor = to_ap1302_dev(sd);
-    struct v4l2_mbus_framefmt *fmt;
+    return 0;
+}
 
-    if (format->pad != 0)
-        return -EINVAL;
+static int ap1302_shadow_write(struct ap1302_dev *sensor, u32 reg, u32 val,
+                               int *err)
+{
+    return ap1302_shadow_update(sensor, reg, U32_MAX, val, err);
+}
 
-    mutex_lock(&sensor->lock);
+/*
+ * Atomic transactions. Register writes between ap1302_atomic_begin() and
+ * ap1302_atomic_commit() are recorded by the AP1302 and applied together on
+ * the next frame boundary.
+ */
+static int ap1302_atomic_begin(struct ap1302_dev *sensor)
+{
+    int ret;
 
-    if (format->which == V4L2_SUBDEV_FORMAT_TRY)
-        v4l2_subdev_get_try_format(&sensor->sd, sd_state,
-                         format->pad);
-    else
-        fmt = &sensor->fmt;
+    if (WARN_ON(sensor->atomic))
+        return -EBUSY;
 
-    fmt->reserved[1] = (sensor->current_fr == AP1302_30_FPS) ? 30 : 15;
-    format->format = *fmt;
+    ret = ap1302_write(sensor, AP1302_ATOMIC,
+                       AP1302_ATOMIC_MODE | AP1302_ATOMIC_RECORD, NULL);
+    if (ret)
+        return ret;
 
-    mutex_unlock(&sensor->lock);
+    sensor->atomic = true;
     return 0;
 }
 
-static int ap1302_try_fmt_internal(struct v4l2_subdev *sd,
-                   struct v4l2_mbus_framefmt *fmt,
-                   enum ap1302_frame_rate fr,
-                   const struct ap1302_mode_info **new_mode)
+/*
+ * Commit the current transaction. @ret is the result of the writes in the
+ * transaction and is returned if non-zero. Recording is ended even on error,
+ * the AP1302 has no way to drop the writes already recorded.
+ */
+static int ap1302_atomic_commit(struct ap1302_dev *sensor, int ret)
 {
-    struct ap1302_dev *sensor = to_ap1302_dev(sd);
-    const struct ap1302_mode_info *mode;
-    int i;
+    int err;
 
-    mode = ap1302_find_mode(sensor, fr, fmt->width, fmt->height, true);
-    if (!mode)
+    if (WARN_ON(!sensor->atomic))
         return -EINVAL;
-    fmt->width = mode->hact;
-    fmt->height = mode->vact;
-    memset(fmt->reserved, 0, sizeof(fmt->reserved));
 
-    if (new_mode)
-        *new_mode = mode;
+    sensor->atomic = false;
 
-    for (i = 0; i < ARRAY_SIZE(ap1302_formats); i++)
-        if (ap1302_formats[i].code == fmt->code)
-            break;
-    if (i >= ARRAY_SIZE(ap1302_formats))
-        i = 0;
+    err = ap1302_write(sensor, AP1302_ATOMIC,
+                       AP1302_ATOMIC_MODE | AP1302_ATOMIC_FINISH, NULL);
 
-    fmt->code = ap1302_formats[i].code;
-    fmt->colorspace = ap1302_formats[i].colorspace;
-    fmt->ycbcr_enc = V4L2_MAP_YCBCR_ENC_DEFAULT(fmt->colorspace);
-    fmt->quantization = V4L2_QUANTIZATION_FULL_RANGE;
-    fmt->xfer_func = V4L2_MAP_XFER_FUNC_DEFAULT(fmt->colorspace);
+    return ret ? ret : err;
+}
 
-    return 0;
+/* Return true if register @next directly follows register @reg. */
+static bool ap1302_reg_follows(u32 reg, u32 next)
+{
+    return !AP1302_REG_PAGE(reg) && !AP1302_REG_PAGE(next) &&
+           AP1302_REG_SIZE(reg) == AP1302_REG_SIZE(next) &&
+           AP1302_REG_ADDR(next) == AP1302_REG_ADDR(reg) +
+                                    AP1302_REG_SIZE(reg);
 }
 
-static int ap1302_set_fmt(struct v4l2_subdev *sd,
-              struct v4l2_subdev_state *sd_state,
-              struct v4l2_subdev_format *format)
+/*
+ * Write the dirty shadowed registers to the hardware, in table order, in a
+ * single I2C transfer. Runs of registers at consecutive addresses are
+ * coalesced into auto-increment writes. Clean registers in the middle of a run
+ * are rewritten with their current value, which is cheaper than a new address
+ * phase. While streaming, the writes are grouped in an atomic transaction to
+ * take effect on the same frame, unless the caller has started one already.
+ */
+static int ap1302_shadow_flush(struct ap1302_dev *sensor)
 {
-    struct ap1302_dev *sensor = to_ap1302_dev(sd);
-    const struct ap1302_mode_info *new_mode;
-    struct v4l2_mbus_framefmt *mbus_fmt = &format->format;
-    struct v4l2_mbus_framefmt *fmt;
-    int ret;
+    struct ap1302_shadow *shadow = &sensor->shadow;
+    unsigned int transfers = sensor->xfer.transfers;
+    bool atomic = sensor->streaming && !sensor->atomic;
+    unsigned int count = 0;
+    unsigned int first, last, i;
+    int ret = 0;
+    int err;
 
-    if (format->pad != 0)
-        return -EINVAL;
+    first = find_first_bit(shadow->dirty, AP1302_NUM_SHADOW_REGS);
+    if (first == AP1302_NUM_SHADOW_REGS)
+        return 0;
 
-    mutex_lock(&sensor->lock);
+    ap1302_xfer_begin(sensor);
 
-    if (sensor->streaming) {
-        ret = -EBUSY;
-        goto out;
+    if (atomic) {
+        ret = ap1302_atomic_begin(sensor);
+        if (ret)
+            goto done;
     }
 
-    ret = ap1302_try_fmt_internal(sd, mbus_fmt,
-                      sensor->current_fr, &new_mode);
-    if (ret)
-        goto out;
+    while (first < AP1302_NUM_SHADOW_REGS) {
+        last = first;
 
-    if (format->which == V4L2_SUBDEV_FORMAT_TRY)
-        fmt = v4l2_subdev_get_try_format(sd, sd_state, 0);
-    else
-        fmt = &sensor->fmt;
+        for (i = first + 1; i < AP1302_NUM_SHADOW_REGS; ++i) {
+            if (!test_bit(i, shadow->valid) ||
+                !ap1302_reg_follows(ap1302_shadow_regs[i - 1],
+                                    ap1302_shadow_regs[i]))
+                break;
+
+            if (test_bit(i, shadow->dirty))
+                last = i;
+        }
+
+        /* Force the write, clean registers would be skipped otherwise. */
+        for (i = first; i <= last; ++i) {
+            if (shadow->mask[i] == U32_MAX)
+                ret = regmap_write(sensor->regmap, ap1302_shadow_regs[i],
+                                   shadow->val[i]);
+            else
+                ret = regmap_write_bits(sensor->regmap,
+                                        ap1302_shadow_regs[i],
+                                        shadow->mask[i], shadow->val[i]);
+            if (ret)
+                break;
+        }
+        if (ret)
+            break;
 
-    *fmt = *mbus_fmt;
+        count += last - first + 1;
 
-    if (new_mode != sensor->current_mode) {
-        sensor->current_mode = new_mode;
-        sensor->pending_mode_change = true;
+        first = find_next_bit(shadow->dirty, AP1302_NUM_SHADOW_REGS,
+                              last + 1);
     }
 
-    if (mbus_fmt->code != sensor->fmt.code)
-        sensor->pending_fmt_change = true;
+    if (atomic)
+        ret = ap1302_atomic_commit(sensor, ret);
 
-    __v4l2_ctrl_s_ctrl_int64(sensor->ctrls.pixel_rate,
-                             ap1302_calc_pixel_rate(sensor));
+done:
+    err = ap1302_xfer_commit(sensor);
+    if (!ret)
+        ret = err;
+    if (ret)
+        return ret;
 
-    if (sensor->pending_mode_change || sensor->pending_fmt_change)
-        sensor->fmt = *mbus_fmt;
+    bitmap_zero(shadow->dirty, AP1302_NUM_SHADOW_REGS);
 
-out:
-    mutex_unlock(&sensor->lock);
-    return ret;
+    dev_dbg(sensor->dev, "Flushed %u shadow registers in %u transfers\n",
+            count, sensor->xfer.transfers - transfers);
+
+    return 0;
 }
 
-static int ap1302_set_framefmt(struct ap1302_dev *sensor,
-                   struct v4l2_mbus_framefmt *format)
+/*
+ * Read a register without logging failures, for polling a chip that NAKs until
+ * it is ready.
+ */
+static int ap1302_read_quiet(struct ap1302_dev *sensor, u32 reg, u32 *val)
 {
-    int ret = 0;
-    bool is_jpeg = false;
-    u8 fmt, mux;
+    u32 page = AP1302_REG_PAGE(reg);
+    ktime_t start;
+    int ret;
 
-    switch (format->code) {
-    case MEDIA_BUS_FMT_UYVY8_2X8:
-    case MEDIA_BUS_FMT_UYVY8_1X16:
-    case MEDIA_BUS_FMT_YUYV8_2X8:
-    case MEDIA_BUS_FMT_YUYV8_1X16:
-    ap1302_write(sensor, AP1302_PREVIEW_OUT_FMT,
-                         AP1302_PREVIEW_OUT_FMT_FT_YUV_JFIF | AP1302_PREVIEW_OUT_FMT_FST_YUV_422, 
-                         &ret);
-        break;
-      default:
-        return -EINVAL;
-        break;
+    if (page) {
+        ret = ap1302_select_page(sensor, page);
+        if (ret < 0)
+            return ret;
+
+        reg &= ~AP1302_REG_PAGE_MASK;
+        reg += AP1302_REG_ADV_START;
     }
 
+    start = ktime_get();
+    ret = regmap_read(sensor->regmap, reg, val);
+    ap1302_stats_record(sensor, reg, false, start, ret);
+
     return ret;
 }
 
 /*
- * Sensor Controls.
+ * __ap1302_poll() - Wait until a register reads back an expected value
+ * @id: Wait identifier, selects the timeout and the statistics slot
+ * @reg: Register to poll
+ * @mask: Bits of the register to compare
+ * @expected: Expected value of the masked bits
+ * @val: Last value read from the register (optional)
+ *
+ * The register is polled with an exponential backoff, starting at
+ * AP1302_POLL_MIN_US and capped to AP1302_POLL_MAX_US between reads. Read
+ * errors are treated as the chip not being ready yet, and are not logged. The
+ * time waited is recorded in the wait statistics.
  */
-
-static int ap1302_set_ctrl_hue(struct ap1302_dev *sensor, int value)
+static int __ap1302_poll(struct ap1302_dev *sensor, enum ap1302_wait_id id,
+                         u32 reg, u32 mask, u32 expected, u32 *val)
 {
-    return 0;
+    const struct ap1302_wait_info *info = &ap1302_waits[id];
+    unsigned int delay_us = AP1302_POLL_MIN_US;
+    unsigned int waited_us;
+    ktime_t start, timeout;
+    unsigned int value = 0;
+    int ret;
+
+    start = ktime_get();
+    timeout = ktime_add_us(start, info->timeout_us);
+
+    for (;;) {
+        ret = ap1302_read_quiet(sensor, reg, &value);
+        if (!ret && (value & mask) == expected)
+            break;
+
+        if (ktime_after(ktime_get(), timeout)) {
+            if (val)
+                *val = value;
+            return -ETIMEDOUT;
+        }
+
+        usleep_range(delay_us, delay_us + delay_us / 2);
+        delay_us = min_t(unsigned int, delay_us * 2, AP1302_POLL_MAX_US);
+    }
+
+    waited_us = ktime_us_delta(ktime_get(), start);
+    sensor->wait_us[id] = waited_us;
+    sensor->wait_max_us[id] = max(sensor->wait_max_us[id], waited_us);
+
+    dev_dbg(sensor->dev, "%s after %u us (fixed delay was %u us)\n",
+            info->name, waited_us, info->fixed_us);
+
+    if (val)
+        *val = value;
+
+    return ret;
 }
 
-static int ap1302_set_ctrl_contrast(struct ap1302_dev *sensor, int value)
+/* Poll a register until it reads back @expected, log once on timeout. */
+static int ap1302_poll(struct ap1302_dev *sensor, enum ap1302_wait_id id,
+                       u32 reg, u32 mask, u32 expected, u32 *val)
 {
-    return 0;
+    u32 value = 0;
+    int ret;
+
+    ret = __ap1302_poll(sensor, id, reg, mask, expected, &value);
+    if (ret == -ETIMEDOUT)
+        dev_err(sensor->dev, "Timeout waiting for %s (0x%04x)\n",
+                ap1302_waits[id].name, value);
+
+    if (val)
+        *val = value;
+
+    return ret;
 }
 
-static int ap1302_set_ctrl_saturation(struct ap1302_dev *sensor, int value)
+/*
+ * Boot phase accounting. Each phase is traced as it completes and accumulated
+ * in the boot statistics, phases repeated by boot retries add up.
+ */
+static void ap1302_boot_start(struct ap1302_dev *sensor)
 {
-    return 0;
+    struct ap1302_boot_stats *stats = &sensor->boot_stats;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->start = ktime_get();
 }
 
-static int ap1302_set_ctrl_white_balance(struct ap1302_dev *sensor, int awb)
+static void ap1302_boot_phase(struct ap1302_dev *sensor,
+                              enum ap1302_boot_phase phase, ktime_t start,
+                              u32 bytes, int ret)
 {
-    return 0;
+    struct ap1302_boot_stats *stats = &sensor->boot_stats;
+    s64 duration_us = ktime_us_delta(ktime_get(), start);
+
+    stats->phase_us[phase] += duration_us;
+    stats->phase_bytes[phase] += bytes;
+
+    trace_ap1302_boot_phase(sensor->i2c_client, phase, bytes, duration_us,
+                            ret);
 }
 
-static int ap1302_set_ctrl_exposure(struct ap1302_dev *sensor,
-                    enum v4l2_exposure_auto_type auto_exposure)
+static void ap1302_boot_end(struct ap1302_dev *sensor, int ret)
 {
-    return 0;
+    struct ap1302_boot_stats *stats = &sensor->boot_stats;
+
+    stats->duration_us = ktime_us_delta(ktime_get(), stats->start);
+    stats->ret = ret;
+
+    trace_ap1302_boot(sensor->i2c_client, stats->retries,
+                      stats->duration_us, ret);
 }
 
-static int ap1302_set_ctrl_gain(struct ap1302_dev *sensor, bool auto_gain)
+static int ap1302_script_validate(struct ap1302_dev *sensor,
+                                  const struct ap1302_script *script)
 {
-    return 0;
-}
+    const u32 *data = script->data;
+    unsigned int pc = 0;
+
+    while (pc < script->len) {
+        unsigned int op = AP1302_SCRIPT_OPCODE(data[pc]);
+        u32 arg = AP1302_SCRIPT_ARG(data[pc]);
+        unsigned int size;
+        u32 count = 0;
+
+        if (op >= ARRAY_SIZE(ap1302_script_operands))
+            goto invalid;
+
+        size = 1 + ap1302_script_operands[op];
+        if (size > script->len - pc)
+            goto invalid;
+
+        if (op == AP1302_SCRIPT_OP_BULK) {
+            count = data[pc + 1];
+            if (count > script->len - pc - size)
+                goto invalid;
+            size += count;
+        }
 
-static const char * const test_pattern_menu[] = {
-    "Disabled",
-    "Color bars",
-    "Color bars w/ rolling bar",
-    "Color squares",
-    "Color squares w/ rolling bar",
-};
+        if (op != AP1302_SCRIPT_OP_DELAY) {
+            unsigned int width = AP1302_REG_SIZE(arg);
 
-#define AP1302_TEST_ENABLE        BIT(7)
-#define AP1302_TEST_ROLLING        BIT(6)    /* rolling horizontal bar */
-#define AP1302_TEST_TRANSPARENT        BIT(5)
-#define AP1302_TEST_SQUARE_BW        BIT(4)    /* black & white squares */
-#define AP1302_TEST_BAR_STANDARD    (0 << 2)
-#define AP1302_TEST_BAR_VERT_CHANGE_1    (1 << 2)
-#define AP1302_TEST_BAR_HOR_CHANGE    (2 << 2)
-#define AP1302_TEST_BAR_VERT_CHANGE_2    (3 << 2)
-#define AP1302_TEST_BAR            (0 << 0)
-#define AP1302_TEST_RANDOM        (1 << 0)
-#define AP1302_TEST_SQUARE        (2 << 0)
-#define AP1302_TEST_BLACK        (3 << 0)
+            if (width != 2 && width != 4)
+                goto invalid;
+            if (AP1302_REG_ADDR(arg) + count * width > 0x10000)
+                goto invalid;
+        }
 
-static const u8 test_pattern_val[] = {
-    0,
-    AP1302_TEST_ENABLE | AP1302_TEST_BAR_VERT_CHANGE_1 |
-        AP1302_TEST_BAR,
-    AP1302_TEST_ENABLE | AP1302_TEST_ROLLING |
-        AP1302_TEST_BAR_VERT_CHANGE_1 | AP1302_TEST_BAR,
-    AP1302_TEST_ENABLE | AP1302_TEST_SQUARE,
-    AP1302_TEST_ENABLE | AP1302_TEST_ROLLING | AP1302_TEST_SQUARE,
-};
+        pc += size;
+    }
 
-static int ap1302_set_ctrl_test_pattern(struct ap1302_dev *sensor, int value)
-{
     return 0;
-}
 
-static int ap1302_set_ctrl_light_freq(struct ap1302_dev *sensor, int value)
-{
-    return 0;
+invalid:
+    dev_err(sensor->dev, "Invalid register script instruction at %u\n", pc);
+    return -EINVAL;
 }
 
-static int ap1302_set_ctrl_hflip(struct ap1302_dev *sensor, int value)
+static int ap1302_script_update(struct ap1302_dev *sensor, u32 reg, u32 mask,
+                                u32 val)
 {
-    /*
-     * If sensor is mounted upside down, mirror logic is inversed.
-     *
-     * Sensor is a BSI (Back Side Illuminated) one,
-     * so image captured is physically mirrored.
-     * This is why mirror logic is inversed in
-     * order to cancel this mirror effect.
-     */
-    return 0;
-}
+    u32 value;
+    int ret;
 
-static int ap1302_set_ctrl_vflip(struct ap1302_dev *sensor, int value)
-{
-    /* If sensor is mounted upside down, flip logic is inversed */
-    return 0;
+    ret = ap1302_read(sensor, reg, &value);
+    if (ret)
+        return ret;
+
+    return ap1302_write(sensor, reg, (value & ~mask) | (val & mask), NULL);
 }
 
-static int ap1302_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+static int ap1302_script_poll(struct ap1302_dev *sensor, u32 reg, u32 mask,
+                              u32 expected, u32 timeout_us)
 {
-    struct v4l2_subdev *sd = ctrl_to_sd(ctrl);
-    struct ap1302_dev *sensor = to_ap1302_dev(sd);
-    int val;
+    unsigned int delay_us = AP1302_POLL_MIN_US;
+    ktime_t timeout;
+    u32 value = 0;
+    int ret;
 
-    return 0;
+    timeout = ktime_add_us(ktime_get(), timeout_us);
+
+    for (;;) {
+        ret = ap1302_read(sensor, reg, &value);
+        if (!ret && (value & mask) == expected)
+            return 0;
+
+        if (ktime_after(ktime_get(), timeout)) {
+            dev_err(sensor->dev,
+                    "Timeout polling register 0x%04x (0x%08x)\n",
+                    AP1302_REG_ADDR(reg), value);
+            return -ETIMEDOUT;
+        }
+
+        usleep_range(delay_us, delay_us + delay_us / 2);
+        delay_us = min_t(unsigned int, delay_us * 2, AP1302_POLL_MAX_US);
+    }
 }
 
-static int ap1302_s_ctrl(struct v4l2_ctrl *ctrl)
+/*
+ * ap1302_script_run() - Execute a register script
+ * @reads: Values of the READ instructions, in order (optional)
+ *
+ * Writes are queued and sent in as few I2C transfers as possible, writes to
+ * consecutive registers are merged. The queue is flushed before polls, delays
+ * and reads of volatile registers to preserve ordering.
+ */
+static int ap1302_script_run(struct ap1302_dev *sensor,
+                             const struct ap1302_script *script, u32 *reads)
 {
-    struct v4l2_subdev *sd = ctrl_to_sd(ctrl);
-    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    unsigned int transfers = sensor->xfer.transfers;
+    const u32 *pc = script->data;
+    const u32 *end = pc + script->len;
+    unsigned int i;
+    u32 value;
     int ret;
 
-    /* v4l2_ctrl_lock() locks our own mutex */
-
-    /*
-     * If the device is not powered up by the host driver do
-     * not apply any controls to H/W at this time. Instead
-     * the controls will be restored right after power-up.
-     */
-    if (sensor->power_count == 0)
+    if (!script->len)
         return 0;
 
-    switch (ctrl->id) {
-    case V4L2_CID_AUTOGAIN:
-        ret = ap1302_set_ctrl_gain(sensor, ctrl->val);
-        break;
-    case V4L2_CID_EXPOSURE_AUTO:
-        ret = ap1302_set_ctrl_exposure(sensor, ctrl->val);
-        break;
-    case V4L2_CID_AUTO_WHITE_BALANCE:
-        ret = ap1302_set_ctrl_white_balance(sensor, ctrl->val);
-        break;
-    case V4L2_CID_HUE:
-        ret = ap1302_set_ctrl_hue(sensor, ctrl->val);
-        break;
-    case V4L2_CID_CONTRAST:
-        ret = ap1302_set_ctrl_contrast(sensor, ctrl->val);
-        break;
-    case V4L2_CID_SATURATION:
-        ret = ap1302_set_ctrl_saturation(sensor, ctrl->val);
-        break;
-    case V4L2_CID_TEST_PATTERN:
-        ret = ap1302_set_ctrl_test_pattern(sensor, ctrl->val);
-        break;
-    case V4L2_CID_POWER_LINE_FREQUENCY:
-        ret = ap1302_set_ctrl_light_freq(sensor, ctrl->val);
-        break;
-    case V4L2_CID_HFLIP:
-        ret = ap1302_set_ctrl_hflip(sensor, ctrl->val);
-        break;
-    case V4L2_CID_VFLIP:
-        ret = ap1302_set_ctrl_vflip(sensor, ctrl->val);
-        break;
-    default:
-        ret = -EINVAL;
-        break;
+    ret = ap1302_script_validate(sensor, script);
+    if (ret)
+        return ret;
+
+    ap1302_xfer_begin(sensor);
+
+    while (!ret && pc < end) {
+        u32 arg = AP1302_SCRIPT_ARG(pc[0]);
+
+        switch (AP1302_SCRIPT_OPCODE(pc[0])) {
+        case AP1302_SCRIPT_OP_WRITE:
+            ret = ap1302_write(sensor, arg, pc[1], NULL);
+            pc += 2;
+            break;
+
+        case AP1302_SCRIPT_OP_UPDATE:
+            ret = ap1302_script_update(sensor, arg, pc[1], pc[2]);
+            pc += 3;
+            break;
+
+        case AP1302_SCRIPT_OP_BULK:
+            for (i = 0; i < pc[1]; ++i)
+                ap1302_write(sensor, arg + i * AP1302_REG_SIZE(arg),
+                             pc[2 + i], &ret);
+            pc += 2 + pc[1];
+            break;
+
+        case AP1302_SCRIPT_OP_POLL:
+            ret = ap1302_script_poll(sensor, arg, pc[1], pc[2], pc[3]);
+            pc += 4;
+            break;
+
+        case AP1302_SCRIPT_OP_DELAY:
+            ret = ap1302_xfer_flush(sensor);
+            if (!ret && arg)
+                usleep_range(arg, arg + arg / 10 + 1);
+            pc += 1;
+            break;
+
+        case AP1302_SCRIPT_OP_READ:
+            ret = ap1302_read(sensor, arg, &value);
+            if (!ret && reads)
+                *reads++ = value;
+            pc += 1;
+            break;
+        }
     }
 
+    if (ret)
+        ap1302_xfer_commit(sensor);
+    else
+        ret = ap1302_xfer_commit(sensor);
+
+    dev_dbg(sensor->dev, "Ran %u words register script in %u transfers: %d\n",
+            script->len, sensor->xfer.transfers - transfers, ret);
+
     return ret;
 }
 
-static const struct v4l2_ctrl_ops ap1302_ctrl_ops = {
-    .g_volatile_ctrl = ap1302_g_volatile_ctrl,
-    .s_ctrl = ap1302_s_ctrl,
-};
-
-static int ap1302_init_controls(struct ap1302_dev *sensor)
+static const struct ap1302_script *
+ap1302_get_script(struct ap1302_dev *sensor,
+                  const struct ap1302_mode_info *mode)
 {
-    const struct v4l2_ctrl_ops *ops = &ap1302_ctrl_ops;
-    struct ap1302_ctrls *ctrls = &sensor->ctrls;
-    struct v4l2_ctrl_handler *hdl = &ctrls->handler;
-    int ret;
+    unsigned int index;
 
-    v4l2_ctrl_handler_init(hdl, 32);
+    if (mode == &ap1302_mode_init_data)
+        index = AP1302_SCRIPT_INIT;
+    else if (mode->id < AP1302_NUM_MODES)
+        index = mode->id;
+    else
+        return &mode->script;
 
-    /* we can use our own mutex for the ctrl lock */
-    hdl->lock = &sensor->lock;
+    if (sensor->scripts[index].data)
+        return &sensor->scripts[index];
 
-    /* Clock related controls */
-    ctrls->pixel_rate = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_PIXEL_RATE,
-                                          0, INT_MAX, 1,
-                                          ap1302_calc_pixel_rate(sensor));
+    return &mode->script;
+}
 
-    /* Auto/manual white balance */
-    ctrls->auto_wb = v4l2_ctrl_new_std(hdl, ops,
-                       V4L2_CID_AUTO_WHITE_BALANCE,
-                       0, 1, 1, 1);
-    ctrls->blue_balance = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_BLUE_BALANCE,
-                        0, 4095, 1, 0);
-    ctrls->red_balance = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_RED_BALANCE,
-                           0, 4095, 1, 0);
-    /* Auto/manual exposure */
-    ctrls->auto_exp = v4l2_ctrl_new_std_menu(hdl, ops,
-                         V4L2_CID_EXPOSURE_AUTO,
-                         V4L2_EXPOSURE_MANUAL, 0,
-                         V4L2_EXPOSURE_AUTO);
-    ctrls->exposure = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_EXPOSURE,
-                        0, 65535, 1, 0);
-    /* Auto/manual gain */
-    ctrls->auto_gain = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_AUTOGAIN,
-                         0, 1, 1, 1);
-    ctrls->gain = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_GAIN,
-                    0, 1023, 1, 0);
+static int ap1302_load_regs(struct ap1302_dev *sensor,
+                const struct ap1302_mode_info *mode)
+{
+    return ap1302_script_run(sensor, ap1302_get_script(sensor, mode), NULL);
+}
 
-    ctrls->saturation = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_SATURATION,
-                          0, 255, 1, 64);
-    ctrls->hue = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_HUE,
-                       0, 359, 1, 0);
-    ctrls->contrast = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_CONTRAST,
-                        0, 255, 1, 0);
-    ctrls->test_pattern =
-        v4l2_ctrl_new_std_menu_items(hdl, ops, V4L2_CID_TEST_PATTERN,
-                         ARRAY_SIZE(test_pattern_menu) - 1,
-                         0, 0, test_pattern_menu);
-    ctrls->hflip = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_HFLIP,
-                     0, 1, 1, 0);
-    ctrls->vflip = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_VFLIP,
-                     0, 1, 1, 0);
+static int ap1302_load_script(struct ap1302_dev *sensor,
+                              struct ap1302_script *script, const char *name)
+{
+    const struct ap1302_script_header *hdr;
+    const struct firmware *fw;
+    struct ap1302_script tmp;
+    const __le32 *words;
+    u32 *data;
+    unsigned int i;
+    u32 len;
+    int ret;
 
-    ctrls->light_freq =
-        v4l2_ctrl_new_std_menu(hdl, ops,
-                       V4L2_CID_POWER_LINE_FREQUENCY,
-                       V4L2_CID_POWER_LINE_FREQUENCY_AUTO, 0,
-                       V4L2_CID_POWER_LINE_FREQUENCY_50HZ);
+    ret = firmware_request_nowarn(&fw, name, sensor->dev);
+    if (ret)
+        return ret;
 
-    if (hdl->error) {
-        ret = hdl->error;
-        goto free_ctrls;
+    hdr = (const struct ap1302_script_header *)fw->data;
+    len = fw->size >= sizeof(*hdr) ? le32_to_cpu(hdr->len) : 0;
+
+    if (fw->size < sizeof(*hdr) ||
+        le32_to_cpu(hdr->magic) != AP1302_SCRIPT_MAGIC ||
+        len != (fw->size - sizeof(*hdr)) / 4) {
+        dev_err(sensor->dev, "Invalid register script %s\n", name);
+        ret = -EINVAL;
+        goto done;
     }
 
-    ctrls->pixel_rate->flags |= V4L2_CTRL_FLAG_READ_ONLY;
-    ctrls->gain->flags |= V4L2_CTRL_FLAG_VOLATILE;
-    ctrls->exposure->flags |= V4L2_CTRL_FLAG_VOLATILE;
+    data = kmalloc_array(len, sizeof(*data), GFP_KERNEL);
+    if (!data) {
+        ret = -ENOMEM;
+        goto done;
+    }
 
-    v4l2_ctrl_auto_cluster(3, &ctrls->auto_wb, 0, false);
-    v4l2_ctrl_auto_cluster(2, &ctrls->auto_gain, 0, true);
-    v4l2_ctrl_auto_cluster(2, &ctrls->auto_exp, 1, true);
+    words = (const __le32 *)(hdr + 1);
+    for (i = 0; i < len; ++i)
+        data[i] = get_unaligned_le32(&words[i]);
 
-    sensor->sd.ctrl_handler = hdl;
-    return 0;
+    tmp.data = data;
+    tmp.len = len;
 
-free_ctrls:
-    v4l2_ctrl_handler_free(hdl);
+    ret = ap1302_script_validate(sensor, &tmp);
+    if (ret) {
+        kfree(data);
+        goto done;
+    }
+
+    *script = tmp;
+    dev_info(sensor->dev, "Loaded register script %s (%u words)\n", name, len);
+
+done:
+    release_firmware(fw);
     return ret;
 }
 
-static int ap1302_enum_frame_size(struct v4l2_subdev *sd,
-                  struct v4l2_subdev_state *sd_state,
-                  struct v4l2_subdev_frame_size_enum *fse)
+/*
+ * Load the register scripts overrides. Missing files are not an error, the
+ * built-in scripts are used instead.
+ */
+static void ap1302_load_scripts(struct ap1302_dev *sensor)
 {
-    if (fse->pad != 0)
-        return -EINVAL;
-    if (fse->index >= AP1302_NUM_MODES)
-        return -EINVAL;
+    unsigned int i;
+    char name[40];
 
-    fse->min_width =
-        ap1302_mode_data[fse->index].hact;
-    fse->max_width = fse->min_width;
-    fse->min_height =
-        ap1302_mode_data[fse->index].vact;
-    fse->max_height = fse->min_height;
+    for (i = 0; i < AP1302_NUM_SCRIPTS; ++i) {
+        if (sensor->scripts[i].data)
+            continue;
 
-    return 0;
+        if (i == AP1302_SCRIPT_INIT)
+            snprintf(name, sizeof(name), "ap1302_script_init.bin");
+        else
+            snprintf(name, sizeof(name), "ap1302_script_%ux%u.bin",
+                     ap1302_mode_data[i].hact, ap1302_mode_data[i].vact);
+
+        ap1302_load_script(sensor, &sensor->scripts[i], name);
+    }
 }
 
-static int ap1302_enum_frame_interval(
-    struct v4l2_subdev *sd,
-    struct v4l2_subdev_state *sd_state,
-    struct v4l2_subdev_frame_interval_enum *fie)
+static void ap1302_release_scripts(struct ap1302_dev *sensor)
 {
-    struct ap1302_dev *sensor = to_ap1302_dev(sd);
-    int i, j, count;
-
-    if (fie->pad != 0)
-        return -EINVAL;
-    if (fie->index >= AP1302_NUM_FRAMERATES)
-        return -EINVAL;
+    unsigned int i;
 
-    if (fie->width == 0 || fie->height == 0 || fie->code == 0) {
-        pr_warn("Please assign pixel format, width and height.\n");
-        return -EINVAL;
+    for (i = 0; i < AP1302_NUM_SCRIPTS; ++i) {
+        kfree(sensor->scripts[i].data);
+        sensor->scripts[i].data = NULL;
+        sensor->scripts[i].len = 0;
     }
 
-    fie->interval.numerator = 1;
+    kfree(sensor->batch.script.data);
+    kfree(sensor->batch.reads);
+    sensor->batch.script.data = NULL;
+    sensor->batch.script.len = 0;
+    sensor->batch.reads = NULL;
+}
 
-    count = 0;
-    for (i = 0; i < AP1302_NUM_FRAMERATES; i++) {
-        for (j = 0; j < AP1302_NUM_MODES; j++) {
-            if (fie->width  == ap1302_mode_data[j].hact &&
-                fie->height == ap1302_mode_data[j].vact &&
-                !ap1302_check_valid_mode(sensor, &ap1302_mode_data[j], i))
-                count++;
-
-            if (fie->index == (count - 1)) {
-                fie->interval.denominator = ap1302_framerates[i];
-                return 0;
-            }
-        }
+/*
+ * Forget the cached values of the registers the debugfs batch may have
+ * written, the driver reads them back from the hardware on next use.
+ */
+static void ap1302_batch_invalidate(struct ap1302_dev *sensor)
+{
+    const struct ap1302_script *script = &sensor->batch.script;
+    const u32 *pc = script->data;
+    const u32 *end = pc + script->len;
+
+    while (pc < end) {
+        unsigned int op = AP1302_SCRIPT_OPCODE(*pc);
+        u32 reg = AP1302_SCRIPT_ARG(*pc);
+        u32 size = AP1302_REG_SIZE(reg);
+        u32 addr = AP1302_REG_ADDR(reg);
+        u32 count = op == AP1302_SCRIPT_OP_BULK ? pc[1] : 1;
+
+        if (AP1302_REG_PAGE(reg))
+            addr += AP1302_REG_ADV_START;
+
+        if (op == AP1302_SCRIPT_OP_WRITE || op == AP1302_SCRIPT_OP_UPDATE ||
+            op == AP1302_SCRIPT_OP_BULK)
+            ap1302_cache_invalidate(sensor, addr, addr + count * size - 1);
+
+        pc += 1 + ap1302_script_operands[op];
+        if (op == AP1302_SCRIPT_OP_BULK)
+            pc += *(pc - 1);
     }
-
-    return -EINVAL;
 }
 
-static int ap1302_g_frame_interval(struct v4l2_subdev *sd,
-                   struct v4l2_subdev_frame_interval *fi)
+/*
+ * Run the debugfs register batch. Must be called with the sensor lock held and
+ * the sensor powered. The batch bypasses the register cache to access the
+ * hardware directly, the registers it writes are then invalidated in the
+ * cache and shadow.
+ */
+static int ap1302_batch_run(struct ap1302_dev *sensor)
 {
-    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    struct ap1302_batch *batch = &sensor->batch;
 
-    mutex_lock(&sensor->lock);
-    fi->interval = sensor->frame_interval;
-    mutex_unlock(&sensor->lock);
+    regcache_cache_bypass(sensor->regmap, true);
+    batch->ret = ap1302_script_run(sensor, &batch->script, batch->reads);
+    regcache_cache_bypass(sensor->regmap, false);
 
-    return 0;
+    ap1302_batch_invalidate(sensor);
+    batch->run = true;
+
+    return batch->ret;
 }
 
-static int ap1302_s_frame_interval(struct v4l2_subdev *sd,
-                   struct v4l2_subdev_frame_interval *fi)
+/*
+ * Parse one line of a register batch into script words. A line holds one
+ * operation, with numbers in C notation:
+ *
+ * - w16|w32 reg val
+ * - u16|u32 reg mask val
+ * - p16|p32 reg mask val timeout_us
+ * - r16|r32 reg
+ * - d us
+ *
+ * Registers are 16-bit addresses, or page | offset for the advanced registers
+ * (e.g. 0x230000). ADVANCED_BASE can't be written, the driver tracks the
+ * selected page. The delays and poll timeouts are accumulated in @wait_us, and
+ * limited to AP1302_BATCH_MAX_WAIT_US in total. Text following a '#' is
+ * ignored.
+ */
+static int ap1302_batch_parse_line(char *line, u32 *words, unsigned int *len,
+                                   unsigned int *num_reads, u32 *wait_us)
 {
-    struct ap1302_dev *sensor = to_ap1302_dev(sd);
-    const struct ap1302_mode_info *mode;
-    int frame_rate, ret = 0;
+    static const u8 opcodes[] = {
+        ['w'] = AP1302_SCRIPT_OP_WRITE,
+        ['u'] = AP1302_SCRIPT_OP_UPDATE,
+        ['p'] = AP1302_SCRIPT_OP_POLL,
+        ['r'] = AP1302_SCRIPT_OP_READ,
+    };
+    unsigned int num_tokens = 0;
+    unsigned int num_args;
+    char *tokens[5];
+    u32 args[4];
+    unsigned int op;
+    unsigned int i;
+    char *tok;
+    u32 reg;
 
-    if (fi->pad != 0)
-        return -EINVAL;
+    while ((tok = strsep(&line, " \t")) != NULL) {
+        if (!*tok)
+            continue;
+        if (*tok == '#')
+            break;
+        if (num_tokens == ARRAY_SIZE(tokens))
+            return -EINVAL;
+        tokens[num_tokens++] = tok;
+    }
 
-    mutex_lock(&sensor->lock);
+    if (!num_tokens)
+        return 0;
 
-    if (sensor->streaming) {
-        ret = -EBUSY;
-        goto out;
+    num_args = num_tokens - 1;
+    for (i = 0; i < num_args; ++i) {
+        if (kstrtou32(tokens[i + 1], 0, &args[i]))
+            return -EINVAL;
     }
 
-    mode = sensor->current_mode;
+    if (!strcmp(tokens[0], "d")) {
+        if (num_args != 1 || args[0] > AP1302_BATCH_MAX_WAIT_US - *wait_us)
+            return -EINVAL;
 
-    frame_rate = ap1302_try_frame_interval(sensor, &fi->interval,
-                           mode->hact, mode->vact);
-    if (frame_rate < 0) {
-        /* Always return a valid frame interval value */
-        fi->interval = sensor->frame_interval;
-        goto out;
-    }
+        *wait_us += args[0];
 
-    mode = ap1302_find_mode(sensor, frame_rate, mode->hact,
-                mode->vact, true);
-    if (!mode) {
-        ret = -EINVAL;
-        goto out;
+        words[(*len)++] = AP1302_SCRIPT_DELAY(args[0]);
+        return 0;
     }
 
-    if (mode != sensor->current_mode ||
-        frame_rate != sensor->current_fr) {
-        sensor->current_fr = frame_rate;
-        sensor->frame_interval = fi->interval;
-        sensor->current_mode = mode;
-        sensor->pending_mode_change = true;
-        __v4l2_ctrl_s_ctrl_int64(sensor->ctrls.pixel_rate,
-                                 ap1302_calc_pixel_rate(sensor));
-    }
-out:
-    mutex_unlock(&sensor->lock);
-    return ret;
-}
+    if (strlen(tokens[0]) != 3 || !strchr("wupr", tokens[0][0]) ||
+        !num_args || args[0] > 0x00ffffff)
+        return -EINVAL;
 
-static int ap1302_enum_mbus_code(struct v4l2_subdev *sd,
-                 struct v4l2_subdev_state *sd_state,
-                 struct v4l2_subdev_mbus_code_enum *code)
-{
-    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    if (!strcmp(&tokens[0][1], "16"))
+        reg = AP1302_REG_16BIT(args[0]);
+    else if (!strcmp(&tokens[0][1], "32"))
+        reg = AP1302_REG_32BIT(args[0]);
+    else
+        return -EINVAL;
 
-    if (code->pad != 0)
+    op = opcodes[(u8)tokens[0][0]];
+    if (num_args != 1 + ap1302_script_operands[op])
         return -EINVAL;
-    if (code->index >= ARRAY_SIZE(ap1302_formats))
+
+    if (op != AP1302_SCRIPT_OP_POLL && op != AP1302_SCRIPT_OP_READ &&
+        !AP1302_REG_PAGE(reg) &&
+        AP1302_REG_ADDR(reg) < AP1302_REG_ADDR(AP1302_ADVANCED_BASE) + 4 &&
+        AP1302_REG_ADDR(reg) + AP1302_REG_SIZE(reg) >
+        AP1302_REG_ADDR(AP1302_ADVANCED_BASE))
         return -EINVAL;
 
-    code->code = ap1302_formats[code->index].code;
+    if (op == AP1302_SCRIPT_OP_POLL) {
+        if (args[3] > AP1302_BATCH_MAX_WAIT_US - *wait_us)
+            return -EINVAL;
+
+        *wait_us += args[3];
+    }
+
+    words[(*len)++] = AP1302_SCRIPT_OP(op, reg);
+    for (i = 1; i < num_args; ++i)
+        words[(*len)++] = args[i];
+
+    if (op == AP1302_SCRIPT_OP_READ)
+        (*num_reads)++;
+
     return 0;
 }
 
-static int ap1302_s_stream(struct v4l2_subdev *sd, int enable)
+/*
+ * ap1302_batch_parse() - Parse a register batch
+ *
+ * Replace the current batch with the one described by @buf, one operation per
+ * line as documented in ap1302_batch_parse_line().
+ */
+static int ap1302_batch_parse(struct ap1302_dev *sensor, char *buf)
 {
-    struct ap1302_dev *sensor = to_ap1302_dev(sd);
-    int ret = 0;
+    struct ap1302_batch *batch = &sensor->batch;
+    struct ap1302_script script;
+    unsigned int num_reads = 0;
+    unsigned int num_lines;
+    unsigned int len = 0;
+    unsigned int lineno = 0;
+    u32 *reads = NULL;
+    u32 wait_us = 0;
+    u32 *words;
+    char *line;
+    int ret;
 
-    mutex_lock(&sensor->lock);
+    /* Each line produces at most 5 words. */
+    num_lines = 1;
+    for (line = buf; *line; ++line)
+        num_lines += *line == '\n';
 
-    if (sensor->streaming == !enable) {
-        ret = ap1302_check_valid_mode(sensor,
-                          sensor->current_mode,
-                          sensor->current_fr);
+    words = kmalloc_array(num_lines, 5 * sizeof(*words), GFP_KERNEL);
+    if (!words)
+        return -ENOMEM;
+
+    while ((line = strsep(&buf, "\n")) != NULL) {
+        lineno++;
+        ret = ap1302_batch_parse_line(line, words, &len, &num_reads,
+                                      &wait_us);
         if (ret) {
-            dev_err(sensor->dev, "Not support WxH@fps=%dx%d@%d\n",
-                sensor->current_mode->hact,
-                sensor->current_mode->vact,
-                ap1302_framerates[sensor->current_fr]);
-            goto out;
+            dev_err(sensor->dev, "Invalid register batch line %u\n",
+                    lineno);
+            goto error;
         }
+    }
 
-        if (enable && sensor->pending_mode_change) {
-            ret = ap1302_set_mode(sensor);
-            if (ret)
-                goto out;
-        }
+    script.data = words;
+    script.len = len;
 
-        if (enable && sensor->pending_fmt_change) {
-            ret = ap1302_set_framefmt(sensor, &sensor->fmt);
-            if (ret)
-                goto out;
-            sensor->pending_fmt_change = false;
+    ret = ap1302_script_validate(sensor, &script);
+    if (ret)
+        goto error;
+
+    if (num_reads) {
+        reads = kcalloc(num_reads, sizeof(*reads), GFP_KERNEL);
+        if (!reads) {
+            ret = -ENOMEM;
+            goto error;
         }
+    }
 
-        if (sensor->ep.bus_type == V4L2_MBUS_CSI2_DPHY)
-            ret = ap1302_set_stream_mipi(sensor, enable);
-        else
-            ret = ap1302_set_stream_dvp(sensor, enable);
+    kfree(batch->script.data);
+    kfree(batch->reads);
 
-        if (!ret)
-            sensor->streaming = enable;
-    }
-out:
-    mutex_unlock(&sensor->lock);
+    batch->script = script;
+    batch->reads = reads;
+    batch->num_reads = num_reads;
+    batch->run = false;
+    batch->ret = 0;
+
+    return 0;
+
+error:
+    kfree(words);
     return ret;
 }
 
-static const struct v4l2_subdev_core_ops ap1302_core_ops = {
-    .s_power = ap1302_s_power,
-    .log_status = v4l2_ctrl_subdev_log_status,
-    .subscribe_event = v4l2_ctrl_subdev_subscribe_event,
-    .unsubscribe_event = v4l2_event_subdev_unsubscribe,
-};
+static int ap1302_set_stream_dvp(struct ap1302_dev *sensor, bool on)
+{
+    int ret;
+    unsigned int flags = sensor->ep.bus.parallel.flags;
 
-static const struct v4l2_subdev_video_ops ap1302_video_ops = {
-    .g_frame_interval = ap1302_g_frame_interval,
-    .s_frame_interval = ap1302_s_frame_interval,
-    .s_stream = ap1302_s_stream,
-};
+    dev_warn(sensor->dev,"not supported\n");
+    return -EINVAL;
+}
 
-static const struct v4l2_subdev_pad_ops ap1302_pad_ops = {
-    .enum_mbus_code = ap1302_enum_mbus_code,
-    .get_fmt = ap1302_get_fmt,
-    .set_fmt = ap1302_set_fmt,
-    .enum_frame_size = ap1302_enum_frame_size,
-    .enum_frame_interval = ap1302_enum_frame_interval,
-};
+static int ap1302_set_stream_mipi(struct ap1302_dev *sensor, bool on)
+{
+    int ret = 0;
 
-static const struct v4l2_subdev_ops ap1302_subdev_ops = {
-    .core = &ap1302_core_ops,
-    .video = &ap1302_video_ops,
-    .pad = &ap1302_pad_ops,
-};
 
-static int ap1302_link_setup(struct media_entity *entity,
-               const struct media_pad *local,
-               const struct media_pad *remote, u32 flags)
+    if (on) {
+        ret = 0;
+    } else {
+        ret = 0;
+    }
+
+    return ret;
+}
+
+static int ap1302_set_virtual_channel(struct ap1302_dev *sensor)
 {
+    u8 temp, channel = virtual_channel;
+    int ret;
+
+    if (channel > 3) {
+        dev_err(sensor->dev,
+            "%s: wrong virtual_channel parameter, expected (0..3), got %d\n",
+            __func__, channel);
+        return -EINVAL;
+    }
     return 0;
 }
 
-static const struct media_entity_operations ap1302_sd_media_ops = {
-    .link_setup = ap1302_link_setup,
-};
+/*
+ * Output pixel rate, the link bandwidth at AP1302_BITS_PER_PIXEL. CSI-2 lanes
+ * carry two bits per link frequency cycle (DDR), parallel buses one sample of
+ * bus-width bits.
+ */
+static u64 ap1302_calc_pixel_rate(struct ap1302_dev *sensor)
+{
+    u64 rate = sensor->link_freq;
 
-static int ap1302_get_regulators(struct ap1302_dev *sensor)
+    if (sensor->ep.bus_type == V4L2_MBUS_CSI2_DPHY)
+        rate *= 2 * max_t(unsigned int, 1,
+                          sensor->ep.bus.mipi_csi2.num_data_lanes);
+    else
+        rate *= sensor->ep.bus.parallel.bus_width ? : 8;
+
+    return div_u64(rate, AP1302_BITS_PER_PIXEL);
+}
+
+/*
+ * Smallest vertical blanking of @mode. Besides the AP1302 minimum, the frame
+ * rate must fit in the 8.8 fixed point MAX_FPS register, which small sizes
+ * would exceed at the full pixel rate.
+ */
+static u32 ap1302_min_vblank(struct ap1302_dev *sensor,
+                             const struct ap1302_mode_info *mode)
 {
-    int i;
+    u64 vtot = DIV64_U64_ROUND_UP((u64)ap1302_calc_pixel_rate(sensor) << 8,
+                                  (u64)mode->htot * U16_MAX);
 
-    for (i = 0; i < AP1302_NUM_SUPPLIES; i++)
-        sensor->supplies[i].supply = ap1302_supply_name[i];
+    return max_t(u64, vtot, mode->vact + AP1302_MIN_VBLANK) - mode->vact;
+}
 
-    return devm_regulator_bulk_get(sensor->dev,
-                       AP1302_NUM_SUPPLIES,
-                       sensor->supplies);
+/*
+ * ap1302_calc_mode() - Compute the output timings for a size
+ *
+ * The ISP scales to any size, the mode is computed at runtime: the blanking
+ * is the minimum supported, the downsizing method is selected from the size,
+ * and the maximum frame rate is limited by the CSI-2 link bandwidth. Sizes
+ * matching a preset pick its register script.
+ */
+static void ap1302_calc_mode(struct ap1302_dev *sensor, u32 width, u32 height,
+                             struct ap1302_mode_info *mode)
+{
+    unsigned int i;
+
+    memset(mode, 0, sizeof(*mode));
+    mode->id = AP1302_MODE_CUSTOM;
+
+    for (i = 0; i < ARRAY_SIZE(ap1302_mode_data); ++i) {
+        if (ap1302_mode_data[i].hact == width &&
+            ap1302_mode_data[i].vact == height) {
+            mode->id = ap1302_mode_data[i].id;
+            mode->script = ap1302_mode_data[i].script;
+            break;
+        }
+    }
+
+    mode->hact = width;
+    mode->vact = height;
+    mode->htot = width + AP1302_MIN_HBLANK;
+    mode->vtot = height + ap1302_min_vblank(sensor, mode);
+    mode->dn_mode = width <= AP1302_SUBSAMPLING_MAX_WIDTH &&
+                    height <= AP1302_SUBSAMPLING_MAX_HEIGHT
+                  ? SUBSAMPLING : SCALING;
+
+    mode->max_fps = div64_u64(ap1302_calc_pixel_rate(sensor),
+                              (u64)mode->htot * mode->vtot);
 }
 
+/* Largest vertical blanking of @mode, for AP1302_MIN_FPS. */
+static u32 ap1302_max_vblank(struct ap1302_dev *sensor,
+                             const struct ap1302_mode_info *mode)
+{
+    u64 vtot = div64_u64(ap1302_calc_pixel_rate(sensor),
+                         (u64)mode->htot * AP1302_MIN_FPS);
+
+    return max_t(u64, vtot, mode->vact + ap1302_min_vblank(sensor, mode)) -
+           mode->vact;
+}
 
-static int ap1302_detect_chip(struct ap1302_dev *sensor)
+/* Frame interval of @mode, from its total size and the pixel rate. */
+static void ap1302_mode_interval(struct ap1302_dev *sensor,
+                                 const struct ap1302_mode_info *mode,
+                                 struct v4l2_fract *fi)
 {
-    unsigned int version;
-    unsigned int revision;
+    u32 pixel_rate = ap1302_calc_pixel_rate(sensor);
+    u32 frame_size = mode->htot * mode->vtot;
+    unsigned long div = gcd(frame_size, pixel_rate);
+
+    fi->numerator = frame_size / div;
+    fi->denominator = pixel_rate / div;
+}
+
+/*
+ * Set the vertical blanking of @mode for the frame interval closest to @fi,
+ * and update @fi to the resulting interval. A zero interval selects the
+ * highest frame rate.
+ */
+static void ap1302_calc_interval(struct ap1302_dev *sensor,
+                                 struct ap1302_mode_info *mode,
+                                 struct v4l2_fract *fi)
+{
+    u32 max_vtot = mode->vact + ap1302_max_vblank(sensor, mode);
+    u64 vtot = 0;
+
+    if (fi->numerator && fi->denominator)
+        vtot = DIV64_U64_ROUND_CLOSEST(ap1302_calc_pixel_rate(sensor) *
+                                       fi->numerator,
+                                       (u64)mode->htot * fi->denominator);
+
+    mode->vtot = clamp_t(u64, vtot,
+                         mode->vact + ap1302_min_vblank(sensor, mode),
+                         max_vtot);
+    ap1302_mode_interval(sensor, mode, fi);
+}
+
+/* Align and clamp a size to the output limits. */
+static void ap1302_align_size(u32 *width, u32 *height)
+{
+    v4l_bound_align_image(width, AP1302_MIN_WIDTH, AP1302_MAX_WIDTH, 1,
+                          height, AP1302_MIN_HEIGHT, AP1302_MAX_HEIGHT, 1, 0);
+}
+
+/*
+ * The AP1302 inserts the vertical blanking needed to output frames at the
+ * MAX_FPS rate. MAX_FPS is assumed to hold frames per second in unsigned 8.8
+ * fixed point, the format still has to be checked against the register
+ * reference.
+ */
+static void ap1302_set_frame_rate(struct ap1302_dev *sensor,
+                                  struct ap1302_context *ctx, int *err)
+{
+    unsigned int n = ctx - sensor->contexts;
+    u64 fps;
+
+    /* 8.8 fixed point, in range per ap1302_min_vblank(). */
+    fps = div64_u64((u64)ap1302_calc_pixel_rate(sensor) << 8,
+                    (u64)ctx->mode.htot * ctx->mode.vtot);
+
+    ap1302_shadow_write(sensor, AP1302_CTX_REG(AP1302_PREVIEW_MAX_FPS, n),
+                        min_t(u64, fps, U16_MAX), err);
+}
+
+/*
+ * if sensor changes inside scaling or subsampling
+ * change mode directly
+ *
+ * The mode script is only run for the selected context, switching to another
+ * context is a single register write.
+ */
+static int ap1302_set_mode_direct(struct ap1302_dev *sensor,
+                  struct ap1302_context *ctx)
+{
+    unsigned int data_lanes = sensor->ep.bus.mipi_csi2.num_data_lanes;
+    unsigned int n = ctx - sensor->contexts;
+    const struct ap1302_mode_info *mode = &ctx->mode;
+    const struct v4l2_rect *roi = &ctx->roi;
+    int ret = 0;
+
+    if (ctx == sensor->ctx) {
+        ret = ap1302_load_regs(sensor, mode);
+        if (ret)
+            return ret;
+    }
+
+    /* Write capture setting */
+    ap1302_shadow_write(sensor, AP1302_CTX_REG(AP1302_PREVIEW_HINF_CTRL, n),
+                        AP1302_PREVIEW_HINF_CTRL_SPOOF |
+                        AP1302_PREVIEW_HINF_CTRL_MIPI_LANES(data_lanes),
+                        &ret);
+
+    ap1302_shadow_write(sensor, AP1302_CTX_REG(AP1302_PREVIEW_WIDTH, n),
+                        mode->hact, &ret);
+    ap1302_shadow_write(sensor, AP1302_CTX_REG(AP1302_PREVIEW_HEIGHT, n),
+                        mode->vact, &ret);
+
+    ap1302_set_frame_rate(sensor, ctx, &ret);
+
+    /* Leave the firmware default ROI until one is set. */
+    if (roi->width) {
+        ap1302_shadow_write(sensor, AP1302_CTX_REG(AP1302_PREVIEW_ROI_X0, n),
+                            roi->left, &ret);
+        ap1302_shadow_write(sensor, AP1302_CTX_REG(AP1302_PREVIEW_ROI_Y0, n),
+                            roi->top, &ret);
+        ap1302_shadow_write(sensor, AP1302_CTX_REG(AP1302_PREVIEW_ROI_X1, n),
+                            roi->left + roi->width, &ret);
+        ap1302_shadow_write(sensor, AP1302_CTX_REG(AP1302_PREVIEW_ROI_Y1, n),
+                            roi->top + roi->height, &ret);
+    }
+
+    return ret;
+}
+
+static int ap1302_set_mode(struct ap1302_dev *sensor,
+                           struct ap1302_context *ctx)
+{
+    const struct ap1302_mode_info *mode = &ctx->mode;
+    enum ap1302_downsize_mode dn_mode, orig_dn_mode;
+    bool auto_gain = sensor->ctrls.auto_gain->val == 1;
+    bool auto_exp =  sensor->ctrls.auto_exp->val == V4L2_EXPOSURE_AUTO;
+    unsigned long rate;
     int ret;
 
-    ret = ap1302_read(sensor, AP1302_CHIP_VERSION, &version);
-    if (ret)
-        return ret;
+    dn_mode = mode->dn_mode;
+    orig_dn_mode = sensor->last_dn_mode;
+
+    if ((dn_mode == SUBSAMPLING && orig_dn_mode == SCALING) ||
+        (dn_mode == SCALING && orig_dn_mode == SUBSAMPLING)) {
+        /*
+         * change between subsampling and scaling
+         * go through exposure calculation
+         */
+        ret = ap1302_set_mode_direct(sensor, ctx);
+    } else {
+        /*
+         * change inside subsampling or scaling
+         * download firmware directly
+         */
+        ret = ap1302_set_mode_direct(sensor, ctx);
+    }
 
-    ret = ap1302_read(sensor, AP1302_CHIP_REV, &revision);
     if (ret)
         return ret;
 
-    if (version != AP1302_CHIP_ID) {
-        dev_err(sensor->dev,
-                "Invalid chip version, expected 0x%04x, got 0x%04x\n",
-                AP1302_CHIP_ID, version);
-        return -EINVAL;
-    }
-
-    dev_info(sensor->dev, "AP1302 revision %u.%u.%u detected\n",
-            (revision & 0xf000) >> 12, (revision & 0x0f00) >> 8,
-             revision & 0x00ff);
+    ctx->pending_mode_change = false;
+    if (ctx == sensor->ctx)
+        sensor->last_dn_mode = mode->dn_mode;
 
     return 0;
 }
 
+static int ap1302_set_framefmt(struct ap1302_dev *sensor,
+                   struct ap1302_context *ctx);
 
-
-static int ap1302_stall(struct ap1302_dev *sensor, bool stall)
+/* restore the last set video mode after chip power-on */
+static int ap1302_restore_mode(struct ap1302_dev *sensor)
 {
+    struct ap1302_context *ctx;
     int ret = 0;
 
-    if (stall) {
-        ap1302_write(sensor, AP1302_SYS_START,
-                     AP1302_SYS_START_PLL_LOCK |
-                     AP1302_SYS_START_STALL_MODE_DISABLED, &ret);
-        ap1302_write(sensor, AP1302_SYS_START,
-                     AP1302_SYS_START_PLL_LOCK |
-                     AP1302_SYS_START_STALL_EN |
-                     AP1302_SYS_START_STALL_MODE_DISABLED, &ret);
+    /* first load the initial register values */
+    ret = ap1302_load_regs(sensor, &ap1302_mode_init_data);
+    if (ret < 0)
+        return ret;
+    sensor->last_dn_mode = ap1302_mode_init_data.dn_mode;
+
+    /* now restore the last capture mode of all contexts */
+    for (ctx = sensor->contexts;
+         ctx < sensor->contexts + AP1302_NUM_CONTEXTS; ++ctx) {
+        ret = ap1302_set_mode(sensor, ctx);
         if (ret < 0)
             return ret;
 
-        msleep(200);
-
-        ap1302_write(sensor, AP1302_ADV_IRQ_SYS_INTE,
-                     AP1302_ADV_IRQ_SYS_INTE_SIPM |
-                     AP1302_ADV_IRQ_SYS_INTE_SIPS_FIFO_WRITE, &ret);
+        ret = ap1302_set_framefmt(sensor, ctx);
         if (ret < 0)
             return ret;
+    }
 
-        sensor->streaming = false;
-        return 0;
-    } else {
-        sensor->streaming = true;
-        return ap1302_write(sensor, AP1302_SYS_START,
-                            AP1302_SYS_START_PLL_LOCK |
-                            AP1302_SYS_START_STALL_STATUS |
-                            AP1302_SYS_START_STALL_EN |
-                            AP1302_SYS_START_STALL_MODE_DISABLED, NULL);
+    ap1302_shadow_update(sensor, AP1302_CTRL, AP1302_CTRL_CONTEXT_MASK,
+                         AP1302_CTRL_CONTEXT(sensor->ctx - sensor->contexts),
+                         &ret);
+    return ret;
+}
+
+/* Update the shadow registers of the contexts configured since last programmed. */
+static int ap1302_program_contexts(struct ap1302_dev *sensor)
+{
+    struct ap1302_context *ctx;
+    int ret;
+
+    for (ctx = sensor->contexts;
+         ctx < sensor->contexts + AP1302_NUM_CONTEXTS; ++ctx) {
+        if (ctx->pending_mode_change) {
+            ret = ap1302_set_mode(sensor, ctx);
+            if (ret)
+                return ret;
+        }
+
+        if (ctx->pending_fmt_change) {
+            ret = ap1302_set_framefmt(sensor, ctx);
+            if (ret)
+                return ret;
+            ctx->pending_fmt_change = false;
+        }
     }
+
+    return 0;
 }
 
-static int ap1302_set_mipi_t3_clk(struct ap1302_dev *sensor)
+/*
+ * Update the blanking controls to the timings of the selected context. The
+ * context registers are programmed separately, the controls are only synced.
+ * The control handler lock must be held.
+ */
+static int ap1302_update_blanking_ctrls(struct ap1302_dev *sensor)
 {
-    unsigned int mipi_t3, t_clk_post, t_clk_pre;
+    const struct ap1302_mode_info *mode = &sensor->ctx->mode;
+    u32 vblank = mode->vtot - mode->vact;
     int ret;
 
-    /* Set the Tclk_post and Tclk_pre values */
-    ret = ap1302_read(sensor, AP1302_ADV_HINF_MIPI_T3, &mipi_t3);
-    if (ret)
-        return ret;
+    sensor->sync_ctrls = true;
 
-    /* Read Tclk post default setting and increment by 2 */
-    t_clk_post = ((mipi_t3 & AP1302_TCLK_POST_MASK)
-                    >> AP1302_TCLK_POST_SHIFT) + 0x5;
-    /* Read Tclk pre default setting and increment by 1 */
-    t_clk_pre = ((mipi_t3 & AP1302_TCLK_PRE_MASK)
-                    >> AP1302_TCLK_PRE_SHIFT) + 0x1;
+    ret = __v4l2_ctrl_modify_range(sensor->ctrls.vblank,
+                                   ap1302_min_vblank(sensor, mode),
+                                   ap1302_max_vblank(sensor, mode), 1,
+                                   vblank);
+    if (!ret)
+        ret = __v4l2_ctrl_s_ctrl(sensor->ctrls.vblank, vblank);
 
-    mipi_t3 = ((mipi_t3 & ~(AP1302_TCLK_POST_MASK))
-                    & ~(AP1302_TCLK_PRE_MASK));
-    mipi_t3 = (mipi_t3 | (t_clk_pre << AP1302_TCLK_PRE_SHIFT)
-                    | t_clk_post);
+    sensor->sync_ctrls = false;
 
-    /* Write MIPI_T3 register with updated Tclk_post and Tclk_pre values */
-    return ap1302_write(sensor, AP1302_ADV_HINF_MIPI_T3, mipi_t3, NULL);
+    return ret;
 }
 
-
-/* -----------------------------------------------------------------------------
- * Boot & Firmware Handling
+/*
+ * Apply the pending configuration while streaming. The mode script and the
+ * shadow registers are written in one atomic transaction, the AP1302 switches
+ * to the new mode on the next frame boundary without stopping the output.
+ *
+ * On failure the caller restores the previous configuration of the context.
+ * Some of the new values may have reached the AP1302, the context is then
+ * left pending to be reprogrammed in full.
  */
+static int ap1302_apply_live(struct ap1302_dev *sensor)
+{
+    int ret;
 
-static int ap1302_request_firmware(struct ap1302_dev *sensor)
+    ret = ap1302_atomic_begin(sensor);
+    if (ret)
+        return ret;
+
+    ret = ap1302_program_contexts(sensor);
+    if (!ret)
+        ret = ap1302_shadow_flush(sensor);
+
+    return ap1302_atomic_commit(sensor, ret);
+}
+
+/* Tell userspace that the output format changed while streaming. */
+static void ap1302_notify_source_change(struct ap1302_dev *sensor)
 {
-    static const char * const suffixes[] = {
-            "",
-            "_single",
-            "_dual",
+    static const struct v4l2_event ev = {
+        .type = V4L2_EVENT_SOURCE_CHANGE,
+        .u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION,
     };
 
-    const struct ap1302_firmware_header *fw_hdr;
-    unsigned int num_sensors=1;
-    unsigned int fw_size;
-    unsigned int i;
-    char name[64];
-    int ret;
+    v4l2_subdev_notify_event(&sensor->sd, &ev);
+}
 
+static int ap1302_power_on(struct ap1302_dev *ap1302)
+{
+    /* 0. RESET was asserted when getting the GPIO. */
 
-    ret = snprintf(name, sizeof(name), "ap1302_%s%s_fw.bin",
-                   "ar0821", suffixes[num_sensors]);
-    if (ret >= sizeof(name)) {
-        dev_err(sensor->dev, "Firmware name too long\n");
-        return -EINVAL;
+    /* 1. Assert STANDBY. */
+    if (ap1302->pwdn_gpio) {
+        gpiod_set_value_cansleep(ap1302->pwdn_gpio, 1);
+        usleep_range(200, 1000);
     }
 
-    dev_dbg(sensor->dev, "Requesting firmware %s\n", name);
+    /* 2. Power up the regulators. To be implemented. */
 
-    ret = request_firmware(&sensor->fw, name, sensor->dev);
-    if (ret) {
-        dev_err(sensor->dev, "Failed to request firmware: %d\n", ret);
-        return ret;
+    /* 3. De-assert STANDBY. */
+    if (ap1302->pwdn_gpio) {
+        gpiod_set_value_cansleep(ap1302->pwdn_gpio, 0);
+        usleep_range(200, 1000);
     }
 
-    /*
-     * The firmware binary contains a header defined by the
-     * ap1302_firmware_header structure. The firmware itself (also referred
-     * to as bootdata) follows the header. Perform sanity checks to ensure
-     * the firmware is valid.
-     */
-    fw_hdr = (const struct ap1302_firmware_header *)sensor->fw->data;
-    fw_size = sensor->fw->size - sizeof(struct ap1302_firmware_header);
+    /* 5. De-assert RESET. */
+    gpiod_set_value_cansleep(ap1302->reset_gpio, 0);
+    ap1302->standby = false;
+
+    /* The advanced register page is reset along with the chip. */
+    ap1302->reg_page = 0;
+
+    /*
+     * 6. Wait for the AP1302 to initialize. The datasheet doesn't specify
+     * how long this takes, poll the chip version until it responds.
+     */
+    return ap1302_poll(ap1302, AP1302_WAIT_CHIP_READY, AP1302_CHIP_VERSION,
+                       0xffff, AP1302_CHIP_ID, NULL);
+}
+
+static void ap1302_power_off(struct ap1302_dev *ap1302)
+{
+    /* 1. Assert RESET. */
+    gpiod_set_value_cansleep(ap1302->reset_gpio, 1);
+
+    /* 3. Assert STANDBY. */
+    if (ap1302->pwdn_gpio) {
+        gpiod_set_value_cansleep(ap1302->pwdn_gpio, 1);
+        usleep_range(200, 1000);
+    }
+
+    /* 4. Power down the regulators. To be implemented. */
+
+    /* 5. De-assert STANDBY. */
+    if (ap1302->pwdn_gpio) {
+        usleep_range(200, 1000);
+        gpiod_set_value_cansleep(ap1302->pwdn_gpio, 0);
+    }
+}
+
+static int ap1302_set_power_on(struct ap1302_dev *sensor)
+{
+    ktime_t start = ktime_get();
+    int ret;
+
+    ret = clk_prepare_enable(sensor->xclk);
+    if (ret) {
+        dev_err(sensor->dev, "%s: failed to enable clock\n",
+            __func__);
+        return ret;
+    }
+
+    ret = regulator_bulk_enable(AP1302_NUM_SUPPLIES,
+                    sensor->supplies);
+    if (ret) {
+        dev_err(sensor->dev, "%s: failed to enable regulators\n",
+            __func__);
+        goto xclk_off;
+    }
+
+    ap1302_boot_phase(sensor, AP1302_PHASE_SUPPLIES, start, 0, 0);
+
+    ret = ap1302_power_on(sensor);
+    if (ret)
+        goto power_off;
+
+    ret = ap1302_init_slave_id(sensor);
+    if (ret)
+        goto power_off;
+
+    return 0;
+
+power_off:
+    ap1302_power_off(sensor);
+    regulator_bulk_disable(AP1302_NUM_SUPPLIES, sensor->supplies);
+xclk_off:
+    clk_disable_unprepare(sensor->xclk);
+    return ret;
+}
+
+static void ap1302_set_power_off(struct ap1302_dev *sensor)
+{
+    ap1302_power_off(sensor);
+    regulator_bulk_disable(AP1302_NUM_SUPPLIES, sensor->supplies);
+    clk_disable_unprepare(sensor->xclk);
+    sensor->streaming = false;
+}
+
+static int ap1302_boot_firmware(struct ap1302_dev *sensor);
+
+/*
+ * The AP1302 loses its configuration when reset. Once the firmware has booted,
+ * write back the configuration registers held in the register cache.
+ */
+static int ap1302_sync_regs(struct ap1302_dev *sensor)
+{
+    regcache_mark_dirty(sensor->regmap);
+    return regcache_sync(sensor->regmap);
+}
+
+/*
+ * The AP1302 keeps its bootdata across STANDBY as long as RESET stays
+ * de-asserted. The bootdata stage and SIP checksum registers both read back
+ * 0xffff once the whole bootdata has been loaded and verified.
+ */
+static bool ap1302_fw_resident(struct ap1302_dev *sensor)
+{
+    unsigned int stage, crc;
+
+    if (ap1302_read(sensor, AP1302_BOOTDATA_STAGE, &stage) ||
+        ap1302_read(sensor, AP1302_SIP_CHECKSUM, &crc))
+        return false;
+
+    return stage == 0xffff && crc == 0xffff;
+}
+
+static int ap1302_set_powerdown_exit(struct ap1302_dev *sensor)
+{
+    ktime_t start;
+    int ret;
+
+    if (!sensor->standby)
+        return 0;
+
+    start = ktime_get();
+
+    /* De-assert STANDBY, RESET has been kept de-asserted. */
+    gpiod_set_value_cansleep(sensor->pwdn_gpio, 0);
+    usleep_range(200, 1000);
+    sensor->standby = false;
+
+    if (ap1302_fw_resident(sensor)) {
+        dev_dbg(sensor->dev, "Warm resume in %lld us\n",
+                ktime_us_delta(ktime_get(), start));
+        return 0;
+    }
+
+    /* The chip lost its state, fall back to a cold boot. */
+    dev_info(sensor->dev, "Firmware lost in standby, reloading\n");
+
+    ap1302_power_off(sensor);
+    ap1302_boot_start(sensor);
+    ret = ap1302_boot_firmware(sensor);
+    ap1302_boot_end(sensor, ret);
+    if (ret)
+        return ret;
+
+    dev_dbg(sensor->dev, "Cold resume in %lld us\n",
+            ktime_us_delta(ktime_get(), start));
+    return 0;
+}
+
+static int ap1302_set_powerdown_enter(struct ap1302_dev *sensor)
+{
+    sensor->streaming = false;
+
+    if (!sensor->pwdn_gpio || sensor->standby)
+        return 0;
+
+    /*
+     * Enter STANDBY without asserting RESET, the AP1302 retains the
+     * bootdata and can be woken up without a firmware upload.
+     */
+    gpiod_set_value_cansleep(sensor->pwdn_gpio, 1);
+    usleep_range(200, 1000);
+    sensor->standby = true;
+
+    return 0;
+}
+
+static int ap1302_set_power(struct ap1302_dev *sensor, bool on)
+{
+    int ret = 0;
+
+    if (on) {
+        ret = ap1302_set_powerdown_exit(sensor);
+        if (ret)
+            return ret;
+
+        ret = ap1302_restore_mode(sensor);
+        if (ret)
+            goto power_off;
+
+        /* We're done here for DVP bus, while CSI-2 needs setup. */
+        if (sensor->ep.bus_type != V4L2_MBUS_CSI2_DPHY)
+            return 0;
+        usleep_range(500, 1000);
+
+    } else {
+        ret = ap1302_set_powerdown_enter(sensor);
+    }
+
+    return 0;
+
+power_off:
+    ap1302_set_powerdown_enter(sensor);
+    return ret;
+}
+
+
+/*
+ * Wait for the firmware boot to complete. This only blocks when called before
+ * the asynchronous boot has finished.
+ */
+static int ap1302_wait_boot(struct ap1302_dev *sensor)
+{
+    if (!completion_done(&sensor->boot_done))
+        wait_for_completion(&sensor->boot_done);
+
+    return sensor->boot_ret;
+}
+
+/* --------------- Subdev Operations --------------- */
+
+static int ap1302_s_power(struct v4l2_subdev *sd, int on)
+{
+    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    int ret;
+
+    ret = ap1302_wait_boot(sensor);
+    if (ret)
+        return ret;
+
+    mutex_lock(&sensor->lock);
+
+    /*
+     * If the power count is modified from 0 to != 0 or from != 0 to 0,
+     * update the power state.
+     */
+    if (sensor->power_count == !on) {
+        ret = ap1302_set_power(sensor, !!on);
+        if (ret)
+            goto out;
+    }
+
+    /* Update the power count. */
+    sensor->power_count += on ? 1 : -1;
+    WARN_ON(sensor->power_count < 0);
+out:
+    mutex_unlock(&sensor->lock);
+
+    if (on && !ret && sensor->power_count == 1) {
+        /* restore controls */
+        
+        ret = v4l2_ctrl_handler_setup(&sensor->ctrls.handler);
+    }
+
+    return ret;
+}
+
+/*
+ * Pick the frame interval closest to @fi for a @width x @height output, within
+ * the rates the CSI-2 link can carry. A zero interval selects the highest
+ * rate. Return the vertical blanking.
+ */
+static u32 ap1302_try_frame_interval(struct ap1302_dev *sensor,
+                     struct v4l2_fract *fi,
+                     u32 width, u32 height)
+{
+    struct ap1302_mode_info mode;
+
+    ap1302_calc_mode(sensor, width, height, &mode);
+    ap1302_calc_interval(sensor, &mode, fi);
+
+    return mode.vtot - mode.vact;
+}
+
+static int ap1302_get_fmt(struct v4l2_subdev *sd,
+              struct v4l2_subdev_state *sd_state,
+              struct v4l2_subdev_format *format)
+{
+    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    struct v4l2_mbus_framefmt *fmt;
+
+    if (format->pad != 0)
+        return -EINVAL;
+
+    mutex_lock(&sensor->lock);
+
+    if (format->which == V4L2_SUBDEV_FORMAT_TRY)
+        v4l2_subdev_get_try_format(&sensor->sd, sd_state,
+                         format->pad);
+    else
+        fmt = &sensor->ctx->fmt;
+
+    fmt->reserved[1] = DIV_ROUND_CLOSEST(sensor->ctx->frame_interval.denominator,
+                                         sensor->ctx->frame_interval.numerator);
+    format->format = *fmt;
+
+    mutex_unlock(&sensor->lock);
+    return 0;
+}
+
+static int ap1302_try_fmt_internal(struct v4l2_subdev *sd,
+                   struct v4l2_mbus_framefmt *fmt,
+                   struct ap1302_mode_info *new_mode)
+{
+    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    int i;
+
+    ap1302_align_size(&fmt->width, &fmt->height);
+    memset(fmt->reserved, 0, sizeof(fmt->reserved));
+
+    if (new_mode)
+        ap1302_calc_mode(sensor, fmt->width, fmt->height, new_mode);
+
+    for (i = 0; i < ARRAY_SIZE(ap1302_formats); i++)
+        if (ap1302_formats[i].code == fmt->code)
+            break;
+    if (i >= ARRAY_SIZE(ap1302_formats))
+        i = 0;
+
+    fmt->code = ap1302_formats[i].code;
+    fmt->colorspace = ap1302_formats[i].colorspace;
+    fmt->ycbcr_enc = V4L2_MAP_YCBCR_ENC_DEFAULT(fmt->colorspace);
+    fmt->quantization = V4L2_QUANTIZATION_FULL_RANGE;
+    fmt->xfer_func = V4L2_MAP_XFER_FUNC_DEFAULT(fmt->colorspace);
+
+    return 0;
+}
+
+static int ap1302_set_fmt(struct v4l2_subdev *sd,
+              struct v4l2_subdev_state *sd_state,
+              struct v4l2_subdev_format *format)
+{
+    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    struct v4l2_mbus_framefmt *mbus_fmt = &format->format;
+    struct ap1302_mode_info new_mode;
+    struct v4l2_mbus_framefmt *fmt;
+    struct ap1302_context *ctx;
+    struct ap1302_context prev;
+    bool changed = false;
+    int ret;
+
+    if (format->pad != 0)
+        return -EINVAL;
+
+    mutex_lock(&sensor->lock);
+
+    ret = ap1302_try_fmt_internal(sd, mbus_fmt, &new_mode);
+    if (ret)
+        goto out;
+
+    if (format->which == V4L2_SUBDEV_FORMAT_TRY) {
+        fmt = v4l2_subdev_get_try_format(sd, sd_state, 0);
+        if (fmt->width != mbus_fmt->width ||
+            fmt->height != mbus_fmt->height)
+            *v4l2_subdev_get_try_crop(sd, sd_state, 0) =
+                (struct v4l2_rect){ };
+        *fmt = *mbus_fmt;
+        goto out;
+    }
+
+    ctx = sensor->ctx;
+    prev = *ctx;
+
+    if (new_mode.hact != ctx->mode.hact ||
+        new_mode.vact != ctx->mode.vact) {
+        /*
+         * Keep the frame interval, lowered to what the link can carry at
+         * the new size.
+         */
+        ap1302_calc_interval(sensor, &new_mode, &ctx->frame_interval);
+        ctx->mode = new_mode;
+        /* The ROI is bounded by the output size, reset it. */
+        ctx->roi = (struct v4l2_rect){ };
+        ctx->pending_mode_change = true;
+        changed = true;
+    }
+
+    if (mbus_fmt->code != ctx->fmt.code) {
+        ctx->pending_fmt_change = true;
+        changed = true;
+    }
+
+    ctx->fmt = *mbus_fmt;
+
+    /* Switch to the new mode on a frame boundary, without a stream restart. */
+    if (sensor->streaming && (ctx->pending_mode_change ||
+                              ctx->pending_fmt_change)) {
+        ret = ap1302_apply_live(sensor);
+        if (ret) {
+            *ctx = prev;
+            ctx->pending_mode_change = true;
+            ctx->pending_fmt_change = true;
+            goto out;
+        }
+
+        if (changed)
+            ap1302_notify_source_change(sensor);
+    }
+
+    ret = ap1302_update_blanking_ctrls(sensor);
+
+out:
+    mutex_unlock(&sensor->lock);
+    return ret;
+}
+
+/*
+ * The ROI is bounded by the output size of @fmt. The active array size of the
+ * sensor behind the AP1302 isn't known to the driver.
+ */
+static void ap1302_crop_bounds(const struct v4l2_mbus_framefmt *fmt,
+                               struct v4l2_rect *rect)
+{
+    rect->left = 0;
+    rect->top = 0;
+    rect->width = fmt->width;
+    rect->height = fmt->height;
+}
+
+static const struct v4l2_mbus_framefmt *
+ap1302_crop_format(struct ap1302_dev *sensor,
+                   struct v4l2_subdev_state *sd_state, u32 which)
+{
+    const struct v4l2_mbus_framefmt *fmt;
+
+    if (which != V4L2_SUBDEV_FORMAT_TRY)
+        return &sensor->ctx->fmt;
+
+    /* The try format is unset until first set, bound by the active one. */
+    fmt = v4l2_subdev_get_try_format(&sensor->sd, sd_state, 0);
+    return fmt->width ? fmt : &sensor->ctx->fmt;
+}
+
+static int ap1302_get_selection(struct v4l2_subdev *sd,
+                                struct v4l2_subdev_state *sd_state,
+                                struct v4l2_subdev_selection *sel)
+{
+    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    const struct v4l2_mbus_framefmt *fmt;
+    int ret = 0;
+
+    if (sel->pad != 0)
+        return -EINVAL;
+
+    mutex_lock(&sensor->lock);
+
+    fmt = ap1302_crop_format(sensor, sd_state, sel->which);
+
+    switch (sel->target) {
+    case V4L2_SEL_TGT_CROP:
+        if (sel->which == V4L2_SUBDEV_FORMAT_TRY)
+            sel->r = *v4l2_subdev_get_try_crop(sd, sd_state, sel->pad);
+        else
+            sel->r = sensor->ctx->roi;
+
+        /* An unset ROI covers the whole output. */
+        if (!sel->r.width)
+            ap1302_crop_bounds(fmt, &sel->r);
+        break;
+
+    case V4L2_SEL_TGT_CROP_DEFAULT:
+    case V4L2_SEL_TGT_CROP_BOUNDS:
+        ap1302_crop_bounds(fmt, &sel->r);
+        break;
+
+    default:
+        ret = -EINVAL;
+        break;
+    }
+
+    mutex_unlock(&sensor->lock);
+    return ret;
+}
+
+/*
+ * Set the ROI of the selected context. It is applied at the next stream start,
+ * or on the next frame boundary while streaming.
+ */
+static int ap1302_set_selection(struct v4l2_subdev *sd,
+                                struct v4l2_subdev_state *sd_state,
+                                struct v4l2_subdev_selection *sel)
+{
+    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    const struct v4l2_mbus_framefmt *fmt;
+    struct v4l2_rect *roi;
+    int ret = 0;
+
+    if (sel->pad != 0 || sel->target != V4L2_SEL_TGT_CROP)
+        return -EINVAL;
+
+    mutex_lock(&sensor->lock);
+
+    fmt = ap1302_crop_format(sensor, sd_state, sel->which);
+
+    sel->r.left = clamp_t(s32, ALIGN(sel->r.left, 2), 0,
+                          fmt->width - AP1302_MIN_WIDTH);
+    sel->r.top = clamp_t(s32, ALIGN(sel->r.top, 2), 0,
+                         fmt->height - AP1302_MIN_HEIGHT);
+    sel->r.width = clamp_t(u32, ALIGN(sel->r.width, 2), AP1302_MIN_WIDTH,
+                           fmt->width - sel->r.left);
+    sel->r.height = clamp_t(u32, ALIGN(sel->r.height, 2), AP1302_MIN_HEIGHT,
+                            fmt->height - sel->r.top);
+
+    if (sel->which == V4L2_SUBDEV_FORMAT_TRY) {
+        *v4l2_subdev_get_try_crop(sd, sd_state, sel->pad) = sel->r;
+        goto out;
+    }
+
+    roi = &sensor->ctx->roi;
+    if (!v4l2_rect_equal(roi, &sel->r)) {
+        struct v4l2_rect prev = *roi;
+
+        *roi = sel->r;
+        sensor->ctx->pending_mode_change = true;
+
+        if (sensor->streaming) {
+            ret = ap1302_apply_live(sensor);
+            if (ret)
+                *roi = prev;
+        }
+    }
+
+out:
+    mutex_unlock(&sensor->lock);
+    return ret;
+}
+
+static int ap1302_set_framefmt(struct ap1302_dev *sensor,
+                   struct ap1302_context *ctx)
+{
+    unsigned int n = ctx - sensor->contexts;
+    int ret = 0;
+    bool is_jpeg = false;
+    u8 fmt, mux;
+
+    switch (ctx->fmt.code) {
+    case MEDIA_BUS_FMT_UYVY8_2X8:
+    case MEDIA_BUS_FMT_UYVY8_1X16:
+    case MEDIA_BUS_FMT_YUYV8_2X8:
+    case MEDIA_BUS_FMT_YUYV8_1X16:
+    ap1302_shadow_write(sensor, AP1302_CTX_REG(AP1302_PREVIEW_OUT_FMT, n),
+                         AP1302_PREVIEW_OUT_FMT_FT_YUV_JFIF | AP1302_PREVIEW_OUT_FMT_FST_YUV_422,
+                         &ret);
+        break;
+      default:
+        return -EINVAL;
+        break;
+    }
+
+    return ret;
+}
+
+/*
+ * Sensor Controls.
+ */
+
+static int ap1302_set_ctrl_hue(struct ap1302_dev *sensor, int value)
+{
+    return 0;
+}
+
+static int ap1302_set_ctrl_contrast(struct ap1302_dev *sensor, int value)
+{
+    return 0;
+}
+
+static int ap1302_set_ctrl_saturation(struct ap1302_dev *sensor, int value)
+{
+    return 0;
+}
+
+static int ap1302_set_ctrl_white_balance(struct ap1302_dev *sensor, int awb)
+{
+    return 0;
+}
+
+static int ap1302_set_ctrl_exposure(struct ap1302_dev *sensor,
+                    enum v4l2_exposure_auto_type auto_exposure)
+{
+    return 0;
+}
+
+static int ap1302_set_ctrl_gain(struct ap1302_dev *sensor, bool auto_gain)
+{
+    return 0;
+}
+
+static const char * const test_pattern_menu[] = {
+    "Disabled",
+    "Color bars",
+    "Color bars w/ rolling bar",
+    "Color squares",
+    "Color squares w/ rolling bar",
+};
+
+#define AP1302_TEST_ENABLE        BIT(7)
+#define AP1302_TEST_ROLLING        BIT(6)    /* rolling horizontal bar */
+#define AP1302_TEST_TRANSPARENT        BIT(5)
+#define AP1302_TEST_SQUARE_BW        BIT(4)    /* black & white squares */
+#define AP1302_TEST_BAR_STANDARD    (0 << 2)
+#define AP1302_TEST_BAR_VERT_CHANGE_1    (1 << 2)
+#define AP1302_TEST_BAR_HOR_CHANGE    (2 << 2)
+#define AP1302_TEST_BAR_VERT_CHANGE_2    (3 << 2)
+#define AP1302_TEST_BAR            (0 << 0)
+#define AP1302_TEST_RANDOM        (1 << 0)
+#define AP1302_TEST_SQUARE        (2 << 0)
+#define AP1302_TEST_BLACK        (3 << 0)
+
+static const u8 test_pattern_val[] = {
+    0,
+    AP1302_TEST_ENABLE | AP1302_TEST_BAR_VERT_CHANGE_1 |
+        AP1302_TEST_BAR,
+    AP1302_TEST_ENABLE | AP1302_TEST_ROLLING |
+        AP1302_TEST_BAR_VERT_CHANGE_1 | AP1302_TEST_BAR,
+    AP1302_TEST_ENABLE | AP1302_TEST_SQUARE,
+    AP1302_TEST_ENABLE | AP1302_TEST_ROLLING | AP1302_TEST_SQUARE,
+};
+
+static int ap1302_set_ctrl_test_pattern(struct ap1302_dev *sensor, int value)
+{
+    return 0;
+}
+
+static int ap1302_set_ctrl_light_freq(struct ap1302_dev *sensor, int value)
+{
+    return 0;
+}
+
+static int ap1302_set_ctrl_hflip(struct ap1302_dev *sensor, int value)
+{
+    /*
+     * If sensor is mounted upside down, mirror logic is inversed.
+     *
+     * Sensor is a BSI (Back Side Illuminated) one,
+     * so image captured is physically mirrored.
+     * This is why mirror logic is inversed in
+     * order to cancel this mirror effect.
+     */
+    return 0;
+}
+
+static int ap1302_set_ctrl_vflip(struct ap1302_dev *sensor, int value)
+{
+    /* If sensor is mounted upside down, flip logic is inversed */
+    return 0;
+}
+
+/*
+ * The vertical blanking sets the frame interval of the selected context, the
+ * AP1302 is programmed with the matching frame rate.
+ */
+static int ap1302_set_ctrl_vblank(struct ap1302_dev *sensor, int value)
+{
+    struct ap1302_context *ctx = sensor->ctx;
+    int ret = 0;
+
+    if (sensor->sync_ctrls)
+        return 0;
+
+    ctx->mode.vtot = ctx->mode.vact + value;
+    ap1302_mode_interval(sensor, &ctx->mode, &ctx->frame_interval);
+    ap1302_set_frame_rate(sensor, ctx, &ret);
+
+    return ret;
+}
+
+/*
+ * Base for the driver private controls, a block of 16 controls past the ones
+ * reserved in <uapi/linux/v4l2-controls.h>. Defined here as long as the driver
+ * isn't part of the kernel tree.
+ */
+#ifndef V4L2_CID_USER_AP1302_BASE
+#define V4L2_CID_USER_AP1302_BASE    (V4L2_CID_USER_BASE + 0x1300)
+#endif
+
+/* Select the output context */
+#define V4L2_CID_AP1302_CONTEXT        (V4L2_CID_USER_AP1302_BASE + 0)
+
+static const char * const ap1302_context_menu[] = {
+    [AP1302_CTX_PREVIEW] = "Preview",
+    [AP1302_CTX_SNAPSHOT] = "Snapshot",
+    [AP1302_CTX_VIDEO] = "Video",
+};
+
+/*
+ * All contexts are programmed when the stream starts, switching to another
+ * one is a single register write. The format and frame interval pad
+ * operations then apply to the new context.
+ */
+static int ap1302_set_ctrl_context(struct ap1302_dev *sensor, int value)
+{
+    const struct v4l2_mbus_framefmt *cur = &sensor->ctx->fmt;
+    const struct v4l2_mbus_framefmt *next = &sensor->contexts[value].fmt;
+    bool changed = cur->width != next->width ||
+                   cur->height != next->height || cur->code != next->code;
+    int ret = 0;
+
+    ap1302_shadow_update(sensor, AP1302_CTRL, AP1302_CTRL_CONTEXT_MASK,
+                         AP1302_CTRL_CONTEXT(value), &ret);
+    if (ret)
+        return ret;
+
+    sensor->ctx = &sensor->contexts[value];
+    sensor->last_dn_mode = sensor->ctx->mode.dn_mode;
+
+    /* Run the mode script of the new context at the next stream start. */
+    if (!sensor->streaming)
+        sensor->ctx->pending_mode_change = true;
+
+    ret = ap1302_update_blanking_ctrls(sensor);
+    if (ret)
+        return ret;
+
+    /* Signal the new output format once the switch has been written. */
+    if (sensor->streaming && changed) {
+        ret = ap1302_shadow_flush(sensor);
+        if (!ret)
+            ap1302_notify_source_change(sensor);
+    }
+
+    return ret;
+}
+
+static int ap1302_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+    struct v4l2_subdev *sd = ctrl_to_sd(ctrl);
+    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    int val;
+
+    return 0;
+}
+
+static int ap1302_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+    struct v4l2_subdev *sd = ctrl_to_sd(ctrl);
+    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    int ret;
+
+    /* v4l2_ctrl_lock() locks our own mutex */
+
+    /*
+     * Controls only update the register shadow, which is written to the
+     * hardware when the stream starts. They can thus be set regardless of
+     * the power state. While streaming, the shadow is flushed right away,
+     * all controls of a cluster take effect on the same frame.
+     */
+
+    switch (ctrl->id) {
+    case V4L2_CID_AUTOGAIN:
+        ret = ap1302_set_ctrl_gain(sensor, ctrl->val);
+        break;
+    case V4L2_CID_EXPOSURE_AUTO:
+        ret = ap1302_set_ctrl_exposure(sensor, ctrl->val);
+        break;
+    case V4L2_CID_AUTO_WHITE_BALANCE:
+        ret = ap1302_set_ctrl_white_balance(sensor, ctrl->val);
+        break;
+    case V4L2_CID_HUE:
+        ret = ap1302_set_ctrl_hue(sensor, ctrl->val);
+        break;
+    case V4L2_CID_CONTRAST:
+        ret = ap1302_set_ctrl_contrast(sensor, ctrl->val);
+        break;
+    case V4L2_CID_SATURATION:
+        ret = ap1302_set_ctrl_saturation(sensor, ctrl->val);
+        break;
+    case V4L2_CID_TEST_PATTERN:
+        ret = ap1302_set_ctrl_test_pattern(sensor, ctrl->val);
+        break;
+    case V4L2_CID_POWER_LINE_FREQUENCY:
+        ret = ap1302_set_ctrl_light_freq(sensor, ctrl->val);
+        break;
+    case V4L2_CID_HFLIP:
+        ret = ap1302_set_ctrl_hflip(sensor, ctrl->val);
+        break;
+    case V4L2_CID_VFLIP:
+        ret = ap1302_set_ctrl_vflip(sensor, ctrl->val);
+        break;
+    case V4L2_CID_VBLANK:
+        ret = ap1302_set_ctrl_vblank(sensor, ctrl->val);
+        break;
+    case V4L2_CID_AP1302_CONTEXT:
+        ret = ap1302_set_ctrl_context(sensor, ctrl->val);
+        break;
+    default:
+        ret = -EINVAL;
+        break;
+    }
+
+    if (!ret && sensor->streaming)
+        ret = ap1302_shadow_flush(sensor);
+
+    return ret;
+}
+
+static const struct v4l2_ctrl_ops ap1302_ctrl_ops = {
+    .g_volatile_ctrl = ap1302_g_volatile_ctrl,
+    .s_ctrl = ap1302_s_ctrl,
+};
+
+static const struct v4l2_ctrl_config ap1302_context_ctrl = {
+    .ops = &ap1302_ctrl_ops,
+    .id = V4L2_CID_AP1302_CONTEXT,
+    .name = "Context",
+    .type = V4L2_CTRL_TYPE_MENU,
+    .max = AP1302_NUM_CONTEXTS - 1,
+    .def = AP1302_CTX_PREVIEW,
+    .qmenu = ap1302_context_menu,
+};
+
+static int ap1302_init_controls(struct ap1302_dev *sensor)
+{
+    const struct v4l2_ctrl_ops *ops = &ap1302_ctrl_ops;
+    const struct ap1302_mode_info *mode = &sensor->ctx->mode;
+    struct ap1302_ctrls *ctrls = &sensor->ctrls;
+    struct v4l2_ctrl_handler *hdl = &ctrls->handler;
+    int ret;
+
+    v4l2_ctrl_handler_init(hdl, 32);
+
+    /* we can use our own mutex for the ctrl lock */
+    hdl->lock = &sensor->lock;
+
+    /* Clock related controls */
+    ctrls->pixel_rate = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_PIXEL_RATE,
+                                          0, INT_MAX, 1,
+                                          ap1302_calc_pixel_rate(sensor));
+
+    /* Blanking, the vertical blanking sets the frame rate */
+    ctrls->hblank = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_HBLANK,
+                                      AP1302_MIN_HBLANK, AP1302_MIN_HBLANK, 1,
+                                      AP1302_MIN_HBLANK);
+    ctrls->vblank = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_VBLANK,
+                                      ap1302_min_vblank(sensor, mode),
+                                      ap1302_max_vblank(sensor, mode), 1,
+                                      mode->vtot - mode->vact);
+
+    /* Auto/manual white balance */
+    ctrls->auto_wb = v4l2_ctrl_new_std(hdl, ops,
+                       V4L2_CID_AUTO_WHITE_BALANCE,
+                       0, 1, 1, 1);
+    ctrls->blue_balance = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_BLUE_BALANCE,
+                        0, 4095, 1, 0);
+    ctrls->red_balance = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_RED_BALANCE,
+                           0, 4095, 1, 0);
+    /* Auto/manual exposure */
+    ctrls->auto_exp = v4l2_ctrl_new_std_menu(hdl, ops,
+                         V4L2_CID_EXPOSURE_AUTO,
+                         V4L2_EXPOSURE_MANUAL, 0,
+                         V4L2_EXPOSURE_AUTO);
+    ctrls->exposure = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_EXPOSURE,
+                        0, 65535, 1, 0);
+    /* Auto/manual gain */
+    ctrls->auto_gain = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_AUTOGAIN,
+                         0, 1, 1, 1);
+    ctrls->gain = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_GAIN,
+                    0, 1023, 1, 0);
+
+    ctrls->saturation = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_SATURATION,
+                          0, 255, 1, 64);
+    ctrls->hue = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_HUE,
+                       0, 359, 1, 0);
+    ctrls->contrast = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_CONTRAST,
+                        0, 255, 1, 0);
+    ctrls->test_pattern =
+        v4l2_ctrl_new_std_menu_items(hdl, ops, V4L2_CID_TEST_PATTERN,
+                         ARRAY_SIZE(test_pattern_menu) - 1,
+                         0, 0, test_pattern_menu);
+    ctrls->hflip = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_HFLIP,
+                     0, 1, 1, 0);
+    ctrls->vflip = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_VFLIP,
+                     0, 1, 1, 0);
+
+    ctrls->light_freq =
+        v4l2_ctrl_new_std_menu(hdl, ops,
+                       V4L2_CID_POWER_LINE_FREQUENCY,
+                       V4L2_CID_POWER_LINE_FREQUENCY_AUTO, 0,
+                       V4L2_CID_POWER_LINE_FREQUENCY_50HZ);
+
+    ctrls->context = v4l2_ctrl_new_custom(hdl, &ap1302_context_ctrl, NULL);
+
+    if (hdl->error) {
+        ret = hdl->error;
+        goto free_ctrls;
+    }
+
+    ctrls->pixel_rate->flags |= V4L2_CTRL_FLAG_READ_ONLY;
+    ctrls->hblank->flags |= V4L2_CTRL_FLAG_READ_ONLY;
+    ctrls->gain->flags |= V4L2_CTRL_FLAG_VOLATILE;
+    ctrls->exposure->flags |= V4L2_CTRL_FLAG_VOLATILE;
+
+    v4l2_ctrl_auto_cluster(3, &ctrls->auto_wb, 0, false);
+    v4l2_ctrl_auto_cluster(2, &ctrls->auto_gain, 0, true);
+    v4l2_ctrl_auto_cluster(2, &ctrls->auto_exp, 1, true);
+
+    sensor->sd.ctrl_handler = hdl;
+    return 0;
+
+free_ctrls:
+    v4l2_ctrl_handler_free(hdl);
+    return ret;
+}
+
+static int ap1302_enum_frame_size(struct v4l2_subdev *sd,
+                  struct v4l2_subdev_state *sd_state,
+                  struct v4l2_subdev_frame_size_enum *fse)
+{
+    if (fse->pad != 0)
+        return -EINVAL;
+    if (fse->index > 0)
+        return -EINVAL;
+
+    /* The ISP scales to any even size within the limits. */
+    fse->min_width = AP1302_MIN_WIDTH;
+    fse->max_width = AP1302_MAX_WIDTH;
+    fse->min_height = AP1302_MIN_HEIGHT;
+    fse->max_height = AP1302_MAX_HEIGHT;
+
+    return 0;
+}
+
+static int ap1302_enum_frame_interval(
+    struct v4l2_subdev *sd,
+    struct v4l2_subdev_state *sd_state,
+    struct v4l2_subdev_frame_interval_enum *fie)
+{
+    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    struct ap1302_mode_info mode;
+    u32 width = fie->width;
+    u32 height = fie->height;
+
+    if (fie->pad != 0)
+        return -EINVAL;
+    if (fie->index >= ARRAY_SIZE(ap1302_framerates))
+        return -EINVAL;
+
+    if (fie->width == 0 || fie->height == 0 || fie->code == 0) {
+        pr_warn("Please assign pixel format, width and height.\n");
+        return -EINVAL;
+    }
+
+    ap1302_align_size(&width, &height);
+    if (width != fie->width || height != fie->height)
+        return -EINVAL;
+
+    ap1302_calc_mode(sensor, width, height, &mode);
+
+    /*
+     * Frame rates are enumerated in increasing order, all up to the max.
+     * Other intervals can be set, see ap1302_s_frame_interval().
+     */
+    if (ap1302_framerates[fie->index] > mode.max_fps)
+        return -EINVAL;
+
+    fie->interval.numerator = 1;
+    fie->interval.denominator = ap1302_framerates[fie->index];
+
+    return 0;
+}
+
+static int ap1302_g_frame_interval(struct v4l2_subdev *sd,
+                   struct v4l2_subdev_frame_interval *fi)
+{
+    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+
+    mutex_lock(&sensor->lock);
+    fi->interval = sensor->ctx->frame_interval;
+    mutex_unlock(&sensor->lock);
+
+    return 0;
+}
+
+static int ap1302_s_frame_interval(struct v4l2_subdev *sd,
+                   struct v4l2_subdev_frame_interval *fi)
+{
+    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    struct ap1302_context *ctx;
+    u32 vblank;
+    int ret;
+
+    if (fi->pad != 0)
+        return -EINVAL;
+
+    mutex_lock(&sensor->lock);
+
+    ctx = sensor->ctx;
+
+    vblank = ap1302_try_frame_interval(sensor, &fi->interval,
+                                       ctx->mode.hact, ctx->mode.vact);
+
+    /*
+     * The frame interval is set through the vertical blanking. While
+     * streaming, only the frame rate register changes, on a frame boundary.
+     */
+    ret = __v4l2_ctrl_s_ctrl(sensor->ctrls.vblank, vblank);
+
+    mutex_unlock(&sensor->lock);
+    return ret;
+}
+
+static int ap1302_enum_mbus_code(struct v4l2_subdev *sd,
+                 struct v4l2_subdev_state *sd_state,
+                 struct v4l2_subdev_mbus_code_enum *code)
+{
+    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+
+    if (code->pad != 0)
+        return -EINVAL;
+    if (code->index >= ARRAY_SIZE(ap1302_formats))
+        return -EINVAL;
+
+    code->code = ap1302_formats[code->index].code;
+    return 0;
+}
+
+static int ap1302_s_stream(struct v4l2_subdev *sd, int enable)
+{
+    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    int ret;
+
+    ret = ap1302_wait_boot(sensor);
+    if (ret)
+        return ret;
+
+    mutex_lock(&sensor->lock);
+
+    if (sensor->streaming == !enable) {
+        /* Program all contexts, to switch between them with one write. */
+        if (enable) {
+            ret = ap1302_program_contexts(sensor);
+            if (ret)
+                goto out;
+        }
+
+        if (enable) {
+            ret = ap1302_shadow_flush(sensor);
+            if (ret)
+                goto out;
+        }
+
+        if (enable && sensor->batch.replay && sensor->batch.script.len) {
+            ret = ap1302_batch_run(sensor);
+            if (ret)
+                goto out;
+        }
+
+        if (sensor->ep.bus_type == V4L2_MBUS_CSI2_DPHY)
+            ret = ap1302_set_stream_mipi(sensor, enable);
+        else
+            ret = ap1302_set_stream_dvp(sensor, enable);
+
+        if (!ret)
+            sensor->streaming = enable;
+    }
+out:
+    mutex_unlock(&sensor->lock);
+    return ret;
+}
+
+#define AP1302_NUM_SINF_PORTS           2
+#define AP1302_NUM_SINF_LANES           4
+
+static int ap1302_log_status(struct v4l2_subdev *sd)
+{
+    struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    struct ap1302_reg_op ops[2 + AP1302_NUM_SINF_PORTS *
+                             AP1302_NUM_SINF_LANES] = {
+        { .reg = AP1302_ADV_IRQ_SYS_INTE },
+        { .reg = AP1302_ADV_CAPTURE_A_FV_CNT },
+    };
+    struct ap1302_reg_op *lanes = &ops[2];
+    unsigned int port, lane;
+    u32 switches;
+    int ret = -ENODEV;
+
+    for (port = 0; port < AP1302_NUM_SINF_PORTS; ++port)
+        for (lane = 0; lane < AP1302_NUM_SINF_LANES; ++lane)
+            lanes[port * AP1302_NUM_SINF_LANES + lane].reg =
+                AP1302_ADV_SINF_MIPI_INTERNAL_p_LANE_n_STAT(port, lane);
+
+    mutex_lock(&sensor->lock);
+    if (sensor->power_count && !sensor->standby) {
+        switches = sensor->page_switches;
+        ret = ap1302_reg_batch(sensor, ops, ARRAY_SIZE(ops));
+        switches = sensor->page_switches - switches;
+    }
+    mutex_unlock(&sensor->lock);
+
+    if (!ret) {
+        dev_info(sensor->dev, "IRQ_SYS_INTE 0x%08x, FV count %u\n",
+                 ops[0].val, ops[1].val);
+
+        for (port = 0; port < AP1302_NUM_SINF_PORTS; ++port) {
+            for (lane = 0; lane < AP1302_NUM_SINF_LANES; ++lane) {
+                u32 stat = lanes[port * AP1302_NUM_SINF_LANES + lane].val;
+
+                dev_info(sensor->dev,
+                         "SINF%u lane %u: state %u, LP %u%s%s\n",
+                         port, lane, AP1302_LANE_STATE(stat),
+                         AP1302_LANE_LP_VAL(stat),
+                         stat & AP1302_LANE_ERR ? ", error" : "",
+                         stat & AP1302_LANE_ABORT ? ", abort" : "");
+            }
+        }
+
+        dev_info(sensor->dev, "Status read with %u page switches\n",
+                 switches);
+    }
+
+    dev_info(sensor->dev, "%u advanced register page switches\n",
+             sensor->page_switches);
+
+    return v4l2_ctrl_subdev_log_status(sd);
+}
+
+static int ap1302_subscribe_event(struct v4l2_subdev *sd, struct v4l2_fh *fh,
+                                  struct v4l2_event_subscription *sub)
+{
+    switch (sub->type) {
+    case V4L2_EVENT_SOURCE_CHANGE:
+        return v4l2_src_change_event_subdev_subscribe(sd, fh, sub);
+    default:
+        return v4l2_ctrl_subdev_subscribe_event(sd, fh, sub);
+    }
+}
+
+static const struct v4l2_subdev_core_ops ap1302_core_ops = {
+    .s_power = ap1302_s_power,
+    .log_status = ap1302_log_status,
+    .subscribe_event = ap1302_subscribe_event,
+    .unsubscribe_event = v4l2_event_subdev_unsubscribe,
+};
+
+static const struct v4l2_subdev_video_ops ap1302_video_ops = {
+    .g_frame_interval = ap1302_g_frame_interval,
+    .s_frame_interval = ap1302_s_frame_interval,
+    .s_stream = ap1302_s_stream,
+};
+
+static const struct v4l2_subdev_pad_ops ap1302_pad_ops = {
+    .enum_mbus_code = ap1302_enum_mbus_code,
+    .get_fmt = ap1302_get_fmt,
+    .set_fmt = ap1302_set_fmt,
+    .enum_frame_size = ap1302_enum_frame_size,
+    .enum_frame_interval = ap1302_enum_frame_interval,
+    .get_selection = ap1302_get_selection,
+    .set_selection = ap1302_set_selection,
+};
+
+static const struct v4l2_subdev_ops ap1302_subdev_ops = {
+    .core = &ap1302_core_ops,
+    .video = &ap1302_video_ops,
+    .pad = &ap1302_pad_ops,
+};
+
+static int ap1302_link_setup(struct media_entity *entity,
+               const struct media_pad *local,
+               const struct media_pad *remote, u32 flags)
+{
+    return 0;
+}
+
+static const struct media_entity_operations ap1302_sd_media_ops = {
+    .link_setup = ap1302_link_setup,
+};
+
+static int ap1302_get_regulators(struct ap1302_dev *sensor)
+{
+    int i;
+
+    for (i = 0; i < AP1302_NUM_SUPPLIES; i++)
+        sensor->supplies[i].supply = ap1302_supply_name[i];
+
+    return devm_regulator_bulk_get(sensor->dev,
+                       AP1302_NUM_SUPPLIES,
+                       sensor->supplies);
+}
+
+
+static int ap1302_detect_chip(struct ap1302_dev *sensor)
+{
+    unsigned int version;
+    unsigned int revision;
+    int ret;
+
+    ret = ap1302_read(sensor, AP1302_CHIP_VERSION, &version);
+    if (ret)
+        return ret;
+
+    ret = ap1302_read(sensor, AP1302_CHIP_REV, &revision);
+    if (ret)
+        return ret;
+
+    if (version != AP1302_CHIP_ID) {
+        dev_err(sensor->dev,
+                "Invalid chip version, expected 0x%04x, got 0x%04x\n",
+                AP1302_CHIP_ID, version);
+        return -EINVAL;
+    }
+
+    dev_info(sensor->dev, "AP1302 revision %u.%u.%u detected\n",
+            (revision & 0xf000) >> 12, (revision & 0x0f00) >> 8,
+             revision & 0x00ff);
+
+    return 0;
+}
+
+
+
+static int ap1302_stall(struct ap1302_dev *sensor, bool stall)
+{
+    int ret = 0;
+
+    if (stall) {
+        ap1302_write(sensor, AP1302_SYS_START,
+                     AP1302_SYS_START_PLL_LOCK |
+                     AP1302_SYS_START_STALL_MODE_DISABLED, &ret);
+        ap1302_write(sensor, AP1302_SYS_START,
+                     AP1302_SYS_START_PLL_LOCK |
+                     AP1302_SYS_START_STALL_EN |
+                     AP1302_SYS_START_STALL_MODE_DISABLED, &ret);
+        if (ret < 0)
+            return ret;
+
+        ret = ap1302_poll(sensor, AP1302_WAIT_STALL, AP1302_SYS_START,
+                          AP1302_SYS_START_STALL_STATUS,
+                          AP1302_SYS_START_STALL_STATUS, NULL);
+        if (ret < 0)
+            return ret;
+
+        ap1302_write(sensor, AP1302_ADV_IRQ_SYS_INTE,
+                     AP1302_ADV_IRQ_SYS_INTE_SIPM |
+                     AP1302_ADV_IRQ_SYS_INTE_SIPS_FIFO_WRITE, &ret);
+        if (ret < 0)
+            return ret;
+
+        sensor->streaming = false;
+        return 0;
+    } else {
+        sensor->streaming = true;
+        return ap1302_write(sensor, AP1302_SYS_START,
+                            AP1302_SYS_START_PLL_LOCK |
+                            AP1302_SYS_START_STALL_STATUS |
+                            AP1302_SYS_START_STALL_EN |
+                            AP1302_SYS_START_STALL_MODE_DISABLED, NULL);
+    }
+}
+
+static int ap1302_set_mipi_t3_clk(struct ap1302_dev *sensor)
+{
+    unsigned int mipi_t3, t_clk_post, t_clk_pre;
+    int ret;
+
+    /* Set the Tclk_post and Tclk_pre values */
+    ret = ap1302_read(sensor, AP1302_ADV_HINF_MIPI_T3, &mipi_t3);
+    if (ret)
+        return ret;
+
+    /* Read Tclk post default setting and increment by 2 */
+    t_clk_post = ((mipi_t3 & AP1302_TCLK_POST_MASK)
+                    >> AP1302_TCLK_POST_SHIFT) + 0x5;
+    /* Read Tclk pre default setting and increment by 1 */
+    t_clk_pre = ((mipi_t3 & AP1302_TCLK_PRE_MASK)
+                    >> AP1302_TCLK_PRE_SHIFT) + 0x1;
+
+    mipi_t3 = ((mipi_t3 & ~(AP1302_TCLK_POST_MASK))
+                    & ~(AP1302_TCLK_PRE_MASK));
+    mipi_t3 = (mipi_t3 | (t_clk_pre << AP1302_TCLK_PRE_SHIFT)
+                    | t_clk_post);
+
+    /* Write MIPI_T3 register with updated Tclk_post and Tclk_pre values */
+    return ap1302_write(sensor, AP1302_ADV_HINF_MIPI_T3, mipi_t3, NULL);
+}
+
+
+/* -----------------------------------------------------------------------------
+ * Firmware Streaming
+ *
+ * Firmware images can be stored compressed with xz or zstd, detected by their
+ * magic number. They are decompressed on the fly during upload, at most one
+ * load window at a time, so the decompressed image is never held in memory.
+ * The decompressed size is read from the container metadata.
+ */
+
+#define AP1302_FW_XZ_DICT_MAX           (1U << 20)
+#define AP1302_FW_ZSTD_WINDOW_MAX       (8U << 20)
+
+enum ap1302_fw_format {
+    AP1302_FW_FORMAT_RAW = 0,
+    AP1302_FW_FORMAT_XZ,
+    AP1302_FW_FORMAT_ZSTD,
+};
+
+struct ap1302_fw_stream {
+    struct ap1302_dev *sensor;
+    enum ap1302_fw_format format;
+    const u8 *in;
+    size_t in_size;
+    size_t in_pos;
+    u8 *buf;
+    bool end;
+    struct xz_dec *xz;
+    zstd_dstream *zstd;
+    void *zstd_wksp;
+};
+
+static const u8 ap1302_xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+static const u8 ap1302_zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+static enum ap1302_fw_format ap1302_fw_format(const struct firmware *fw)
+{
+    if (fw->size >= sizeof(ap1302_xz_magic) &&
+        !memcmp(fw->data, ap1302_xz_magic, sizeof(ap1302_xz_magic)))
+        return AP1302_FW_FORMAT_XZ;
+
+    if (fw->size >= sizeof(ap1302_zstd_magic) &&
+        !memcmp(fw->data, ap1302_zstd_magic, sizeof(ap1302_zstd_magic)))
+        return AP1302_FW_FORMAT_ZSTD;
+
+    return AP1302_FW_FORMAT_RAW;
+}
+
+static void ap1302_fw_stream_close(struct ap1302_fw_stream *stream)
+{
+    if (stream->xz)
+        xz_dec_end(stream->xz);
+    kvfree(stream->zstd_wksp);
+    kfree(stream->buf);
+}
+
+static int ap1302_fw_stream_open(struct ap1302_dev *sensor,
+                                 struct ap1302_fw_stream *stream)
+{
+    zstd_frame_header params;
+    size_t wksp_size;
+
+    memset(stream, 0, sizeof(*stream));
+    stream->sensor = sensor;
+    stream->format = ap1302_fw_format(sensor->fw);
+    stream->in = sensor->fw->data;
+    stream->in_size = sensor->fw->size;
+
+    switch (stream->format) {
+    case AP1302_FW_FORMAT_RAW:
+        return 0;
+
+    case AP1302_FW_FORMAT_XZ:
+        if (!IS_ENABLED(CONFIG_XZ_DEC))
+            goto unsupported;
+
+        stream->xz = xz_dec_init(XZ_DYNALLOC, AP1302_FW_XZ_DICT_MAX);
+        if (!stream->xz)
+            return -ENOMEM;
+        break;
+
+    case AP1302_FW_FORMAT_ZSTD:
+        if (!IS_ENABLED(CONFIG_ZSTD_DECOMPRESS))
+            goto unsupported;
+
+        if (zstd_get_frame_header(&params, stream->in, stream->in_size) ||
+            params.windowSize > AP1302_FW_ZSTD_WINDOW_MAX) {
+            dev_err(sensor->dev, "Invalid zstd firmware frame\n");
+            return -EINVAL;
+        }
+
+        wksp_size = zstd_dstream_workspace_bound(params.windowSize);
+        stream->zstd_wksp = kvmalloc(wksp_size, GFP_KERNEL);
+        if (!stream->zstd_wksp)
+            return -ENOMEM;
+
+        stream->zstd = zstd_init_dstream(params.windowSize,
+                                         stream->zstd_wksp, wksp_size);
+        if (!stream->zstd) {
+            ap1302_fw_stream_close(stream);
+            return -EINVAL;
+        }
+        break;
+    }
+
+    stream->buf = kmalloc(AP1302_FW_WINDOW_SIZE, GFP_KERNEL);
+    if (!stream->buf) {
+        ap1302_fw_stream_close(stream);
+        return -ENOMEM;
+    }
+
+    return 0;
+
+unsupported:
+    dev_err(sensor->dev, "Compressed firmware support not enabled\n");
+    return -EOPNOTSUPP;
+}
+
+/* Decode an xz variable length integer, return its length or 0 if invalid. */
+static size_t ap1302_xz_vli(const u8 *buf, size_t size, u64 *val)
+{
+    size_t i;
+
+    *val = 0;
+
+    for (i = 0; i < min_t(size_t, size, 9); ++i) {
+        *val |= (u64)(buf[i] & 0x7f) << (i * 7);
+        if (!(buf[i] & 0x80))
+            return i + 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Sum the uncompressed sizes of the blocks listed in the index of an xz
+ * stream. The index precedes the 12 bytes stream footer, which stores its
+ * size.
+ */
+static int ap1302_xz_unpacked_size(const u8 *in, size_t in_size, u64 *size)
+{
+    static const u8 footer_magic[] = { 'Y', 'Z' };
+    const u8 *footer, *index;
+    size_t index_size;
+    u64 records, val;
+    size_t pos, len;
+
+    /* Skip the stream padding. */
+    while (in_size >= 4 && !get_unaligned_le32(in + in_size - 4))
+        in_size -= 4;
+
+    if (in_size < 12)
+        return -EINVAL;
+
+    footer = in + in_size - 12;
+    if (memcmp(footer + 10, footer_magic, sizeof(footer_magic)))
+        return -EINVAL;
+
+    /* The smallest index holds the indicator, a count and the CRC32. */
+    index_size = ((size_t)get_unaligned_le32(footer + 4) + 1) * 4;
+    if (index_size < 8 || index_size > in_size - 12)
+        return -EINVAL;
+
+    index = footer - index_size;
+    if (index[0] != 0x00)
+        return -EINVAL;
+
+    /* Exclude the CRC32 from the index. */
+    index_size -= 4;
+    pos = 1;
+
+    len = ap1302_xz_vli(index + pos, index_size - pos, &records);
+    if (!len)
+        return -EINVAL;
+    pos += len;
+
+    /* Each record takes at least two bytes. */
+    if (records > (index_size - pos) / 2)
+        return -EINVAL;
+
+    *size = 0;
+
+    while (records--) {
+        /* Unpadded size, then uncompressed size. */
+        if (pos > index_size)
+            return -EINVAL;
+        len = ap1302_xz_vli(index + pos, index_size - pos, &val);
+        if (!len)
+            return -EINVAL;
+        pos += len;
+
+        if (pos > index_size)
+            return -EINVAL;
+        len = ap1302_xz_vli(index + pos, index_size - pos, &val);
+        if (!len)
+            return -EINVAL;
+        pos += len;
+
+        if (check_add_overflow(*size, val, size))
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * ap1302_fw_unpacked_size() - Get the size of the uncompressed firmware
+ *
+ * Read the size from the container metadata without decompressing: the frame
+ * content size for zstd, and the stream index for xz. Return -ENODATA if the
+ * zstd frame doesn't record its content size.
+ */
+static int ap1302_fw_unpacked_size(struct ap1302_fw_stream *stream,
+                                   size_t *size)
+{
+    zstd_frame_header params;
+    u64 unpacked;
+    int ret;
+
+    switch (stream->format) {
+    case AP1302_FW_FORMAT_RAW:
+    default:
+        *size = stream->in_size;
+        return 0;
+
+    case AP1302_FW_FORMAT_XZ:
+        ret = ap1302_xz_unpacked_size(stream->in, stream->in_size,
+                                      &unpacked);
+        if (ret) {
+            dev_err(stream->sensor->dev, "Invalid xz firmware index\n");
+            return ret;
+        }
+        break;
+
+    case AP1302_FW_FORMAT_ZSTD:
+        if (zstd_get_frame_header(&params, stream->in, stream->in_size))
+            return -EINVAL;
+
+        if (params.frameContentSize == ZSTD_CONTENTSIZE_UNKNOWN)
+            return -ENODATA;
+
+        unpacked = params.frameContentSize;
+        break;
+    }
+
+    if (unpacked > U32_MAX)
+        return -EFBIG;
+
+    *size = unpacked;
+    return 0;
+}
+
+/*
+ * ap1302_fw_stream_read() - Read the next bytes of the firmware
+ * @data: Set to the bytes read, valid until the next read
+ * @len: Number of bytes to read, at most one load window
+ *
+ * Return the number of bytes read, which is only short of @len at the end of
+ * the firmware, or a negative error code.
+ */
+static int ap1302_fw_stream_read(struct ap1302_fw_stream *stream,
+                                 const u8 **data, size_t len)
+{
+    struct device *dev = stream->sensor->dev;
+    size_t out_pos = 0;
+
+    if (WARN_ON(len > AP1302_FW_WINDOW_SIZE))
+        return -EINVAL;
+
+    if (stream->format == AP1302_FW_FORMAT_RAW) {
+        len = min(len, stream->in_size - stream->in_pos);
+        *data = stream->in + stream->in_pos;
+        stream->in_pos += len;
+        return len;
+    }
+
+    while (out_pos < len && !stream->end) {
+        if (stream->format == AP1302_FW_FORMAT_XZ) {
+            struct xz_buf b = {
+                .in = stream->in,
+                .in_pos = stream->in_pos,
+                .in_size = stream->in_size,
+                .out = stream->buf,
+                .out_pos = out_pos,
+                .out_size = len,
+            };
+            enum xz_ret xz_ret;
+
+            xz_ret = xz_dec_run(stream->xz, &b);
+            stream->in_pos = b.in_pos;
+            out_pos = b.out_pos;
+
+            if (xz_ret == XZ_STREAM_END) {
+                stream->end = true;
+            } else if (xz_ret != XZ_OK) {
+                dev_err(dev, "xz decompression failed: %d\n", xz_ret);
+                return -EINVAL;
+            }
+        } else {
+            zstd_in_buffer in = {
+                .src = stream->in,
+                .size = stream->in_size,
+                .pos = stream->in_pos,
+            };
+            zstd_out_buffer out = {
+                .dst = stream->buf,
+                .size = len,
+                .pos = out_pos,
+            };
+            size_t zstd_ret;
+
+            zstd_ret = zstd_decompress_stream(stream->zstd, &out, &in);
+            if (zstd_is_error(zstd_ret)) {
+                dev_err(dev, "zstd decompression failed: %d\n",
+                        zstd_get_error_code(zstd_ret));
+                return -EINVAL;
+            }
+
+            stream->in_pos = in.pos;
+            out_pos = out.pos;
+
+            if (!zstd_ret) {
+                stream->end = true;
+            } else if (in.pos == in.size && out.pos < out.size) {
+                dev_err(dev, "Truncated zstd firmware\n");
+                return -EINVAL;
+            }
+        }
+    }
+
+    *data = stream->buf;
+    return out_pos;
+}
+
+/* -----------------------------------------------------------------------------
+ * Boot & Firmware Handling
+ */
+
+/*
+ * Firmware images are shared by all AP1302 instances using the same image.
+ * They are cached by name and refcounted, so a multi-camera system reads and
+ * validates each image only once. The cache lock only covers the lookup and
+ * insertion of entries. The instance that inserts an entry requests the image
+ * without the lock, other instances needing the same image wait for the entry
+ * to complete instead of requesting it again, and requests for different
+ * images proceed in parallel. A failed entry is removed from the cache for the
+ * next request to retry.
+ */
+struct ap1302_fw_cache_entry {
+    struct list_head list;
+    struct kref ref;
+    char name[64];
+    struct completion loaded;
+    int ret;
+    const struct firmware *fw;
+    struct ap1302_firmware_header hdr;
+    u32 size;
+};
+
+static LIST_HEAD(ap1302_fw_cache);
+static DEFINE_MUTEX(ap1302_fw_cache_lock);
+
+static void ap1302_fw_cache_release(struct kref *ref)
+    __releases(&ap1302_fw_cache_lock)
+{
+    struct ap1302_fw_cache_entry *entry =
+        container_of(ref, struct ap1302_fw_cache_entry, ref);
+
+    list_del(&entry->list);
+    mutex_unlock(&ap1302_fw_cache_lock);
+
+    release_firmware(entry->fw);
+    kfree(entry);
+}
+
+static void ap1302_release_firmware(struct ap1302_dev *sensor)
+{
+    if (sensor->fw_entry)
+        kref_put_mutex(&sensor->fw_entry->ref, ap1302_fw_cache_release,
+                       &ap1302_fw_cache_lock);
+    sensor->fw_entry = NULL;
+    sensor->fw = NULL;
+}
+
+/*
+ * Firmware file extensions, in lookup order. Compressed images are preferred
+ * and decompressed by the driver while uploading.
+ */
+static const char * const ap1302_fw_extensions[] = {
+    ".zst",
+    ".xz",
+    "",
+};
+
+static int ap1302_firmware_name(struct ap1302_dev *sensor, char *name,
+                                size_t size)
+{
+    static const char * const suffixes[] = {
+            "",
+            "_single",
+            "_dual",
+    };
+
+    unsigned int num_sensors=1;
+    int ret;
+
+    ret = snprintf(name, size, "ap1302_%s%s_fw.bin",
+                   "ar0821", suffixes[num_sensors]);
+    if (ret >= size) {
+        dev_err(sensor->dev, "Firmware name too long\n");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int ap1302_check_firmware(struct ap1302_dev *sensor)
+{
+    struct ap1302_fw_stream stream;
+    const u8 *data;
+    size_t size = 0;
+    int ret;
+
+    ret = ap1302_fw_stream_open(sensor, &stream);
+    if (ret)
+        return ret;
+
+    /*
+     * The firmware binary contains a header defined by the
+     * ap1302_firmware_header structure. The firmware itself (also referred
+     * to as bootdata) follows the header. Perform sanity checks to ensure
+     * the firmware is valid.
+     */
+    ret = ap1302_fw_stream_read(&stream, &data, sizeof(sensor->fw_hdr));
+    if (ret < 0)
+        goto done;
+
+    if (ret < sizeof(sensor->fw_hdr)) {
+        dev_err(sensor->dev, "Invalid firmware: too small\n");
+        ret = -EINVAL;
+        goto done;
+    }
+
+    memcpy(&sensor->fw_hdr, data, sizeof(sensor->fw_hdr));
+
+    /*
+     * Take the bootdata size from the container metadata, compressed images
+     * are then only decompressed while uploading. A zstd frame without a
+     * content size is walked to compute it.
+     */
+    ret = ap1302_fw_unpacked_size(&stream, &size);
+    if (ret == -ENODATA) {
+        dev_dbg(sensor->dev, "No firmware content size, decompressing\n");
+
+        size = sizeof(sensor->fw_hdr);
+        do {
+            ret = ap1302_fw_stream_read(&stream, &data,
+                                        AP1302_FW_WINDOW_SIZE);
+            if (ret < 0)
+                goto done;
+            size += ret;
+        } while (ret == AP1302_FW_WINDOW_SIZE);
+    } else if (ret) {
+        goto done;
+    }
+
+    if (size < sizeof(sensor->fw_hdr)) {
+        dev_err(sensor->dev, "Invalid firmware: too small\n");
+        ret = -EINVAL;
+        goto done;
+    }
+
+    sensor->fw_size = size - sizeof(sensor->fw_hdr);
+    ret = 0;
+
+    if (sensor->fw_hdr.pll_init_size > sensor->fw_size) {
+        dev_err(sensor->dev, "Invalid firmware: PLL init size too large\n");
+        ret = -EINVAL;
+        goto done;
+    }
+
+    if (stream.format != AP1302_FW_FORMAT_RAW)
+        dev_dbg(sensor->dev, "Compressed firmware: %zu bytes, %u unpacked\n",
+                sensor->fw->size, sensor->fw_size);
+
+done:
+    ap1302_fw_stream_close(&stream);
+    return ret;
+}
+
+/*
+ * Request the firmware file @name, trying compressed variants first, and
+ * validate it. Called without the firmware cache lock held.
+ */
+static int ap1302_fw_cache_load(struct ap1302_dev *sensor,
+                                struct ap1302_fw_cache_entry *entry)
+{
+    unsigned int ext;
+    char name[72];
+    int ret;
+
+    for (ext = 0; ext < ARRAY_SIZE(ap1302_fw_extensions); ++ext) {
+        snprintf(name, sizeof(name), "%s%s", entry->name,
+                 ap1302_fw_extensions[ext]);
+
+        dev_dbg(sensor->dev, "Requesting firmware %s\n", name);
+
+        /* Only warn about the uncompressed image missing. */
+        if (ext < ARRAY_SIZE(ap1302_fw_extensions) - 1)
+            ret = firmware_request_nowarn(&entry->fw, name, sensor->dev);
+        else
+            ret = request_firmware(&entry->fw, name, sensor->dev);
+        if (!ret)
+            break;
+    }
+
+    if (ret) {
+        dev_err(sensor->dev, "Failed to request firmware: %d\n", ret);
+        return ret;
+    }
+
+    sensor->fw = entry->fw;
+    ret = ap1302_check_firmware(sensor);
+    sensor->fw = NULL;
+    if (ret) {
+        release_firmware(entry->fw);
+        entry->fw = NULL;
+        return ret;
+    }
+
+    entry->hdr = sensor->fw_hdr;
+    entry->size = sensor->fw_size;
+
+    return 0;
+}
+
+static int ap1302_request_firmware(struct ap1302_dev *sensor)
+{
+    struct ap1302_fw_cache_entry *entry;
+    bool cached = false;
+    char name[64];
+    int ret;
+
+    ret = ap1302_firmware_name(sensor, name, sizeof(name));
+    if (ret)
+        return ret;
+
+    mutex_lock(&ap1302_fw_cache_lock);
+
+    list_for_each_entry(entry, &ap1302_fw_cache, list) {
+        if (!strcmp(entry->name, name)) {
+            kref_get(&entry->ref);
+            cached = true;
+            break;
+        }
+    }
+
+    if (!cached) {
+        entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+        if (!entry) {
+            mutex_unlock(&ap1302_fw_cache_lock);
+            return -ENOMEM;
+        }
+
+        strscpy(entry->name, name, sizeof(entry->name));
+        kref_init(&entry->ref);
+        init_completion(&entry->loaded);
+        list_add_tail(&entry->list, &ap1302_fw_cache);
+    }
+
+    mutex_unlock(&ap1302_fw_cache_lock);
+
+    if (cached) {
+        dev_dbg(sensor->dev, "Using cached firmware %s\n", name);
+        wait_for_completion(&entry->loaded);
+        ret = entry->ret;
+    } else {
+        ret = ap1302_fw_cache_load(sensor, entry);
+        if (ret) {
+            mutex_lock(&ap1302_fw_cache_lock);
+            list_del_init(&entry->list);
+            mutex_unlock(&ap1302_fw_cache_lock);
+        }
+
+        entry->ret = ret;
+        complete_all(&entry->loaded);
+    }
+
+    if (ret) {
+        kref_put_mutex(&entry->ref, ap1302_fw_cache_release,
+                       &ap1302_fw_cache_lock);
+        return ret;
+    }
+
+    sensor->fw_entry = entry;
+    sensor->fw = entry->fw;
+    sensor->fw_hdr = entry->hdr;
+    sensor->fw_size = entry->size;
+
+    return 0;
+}
+
+/*
+ * ap1302_fw_burst_len() - Compute the largest firmware upload burst
+ *
+ * Each burst is sent as a single I2C write of a 16-bit register address
+ * followed by the payload. Size it to the largest transfer the adapter can
+ * carry, bounded by the firmware load window.
+ */
+static unsigned int ap1302_fw_burst_len(struct ap1302_dev *sensor)
+{
+    struct i2c_adapter *adapter = sensor->i2c_client->adapter;
+    const struct i2c_adapter_quirks *quirks = adapter->quirks;
+    size_t len = AP1302_FW_WINDOW_SIZE;
+    size_t max;
+
+    if (quirks && quirks->max_write_len) {
+        max = quirks->max_write_len;
+
+        /*
+         * Adapters supporting I2C_M_NOSTART receive the address and the
+         * payload as two messages combined in one transfer. Otherwise the
+         * address is copied in front of the payload and counts against the
+         * message length limit.
+         */
+        if (!i2c_check_functionality(adapter, I2C_FUNC_NOSTART))
+            max = max > 2 ? max - 2 : 0;
+
+        len = min(len, max);
+    }
+
+    /* Bursts must cover whole 16-bit registers. */
+    len = round_down(len, 2);
+
+    return len ? len : 2;
+}
+
+/*
+ * ap1302_write_fw_window() - Write a piece of firmware to the AP1302
+ * @win_pos: Firmware load window current position
+ * @buf: Firmware data buffer
+ * @len: Firmware data length
+ *
+ * The firmware is loaded through a window in the registers space. Writes are
+ * sequential starting at address 0x8000, and must wrap around when reaching
+ * 0x9fff. This function write the firmware data stored in @buf to the AP1302,
+ * keeping track of the window position in the @win_pos argument. Data is sent
+ * in bursts of at most @burst_len bytes, split at the window wrap-around
+ * point.
+ */
+ 
+static int ap1302_write_fw_block(struct ap1302_dev *sensor, const u8 *buf,
+                  u32 len, unsigned int *win_pos, u32 burst_len) {
+    unsigned int wr_pos = *win_pos;
+    unsigned int write_addr;
+    u32 offset, burst;
+    int ret;
+
+    while (len) {
+        offset = wr_pos % AP1302_FW_WINDOW_SIZE;
+        burst = min_t(u32, len, burst_len);
+        burst = min_t(u32, burst, AP1302_FW_WINDOW_SIZE - offset);
+
+        write_addr = offset + AP1302_FW_WINDOW_OFFSET;
+        ret = ap1302_write_raw(sensor, write_addr, buf, burst);
+        if (ret) {
+            dev_err(sensor->dev, "%s: ap1302_write_raw error = %d\n", __func__, ret);
+            return ret;
+        }
+        buf += burst;
+        wr_pos += burst;
+        len -= burst;
+    }
+
+    *win_pos = wr_pos;
+    return 0;
+}
+
+/*
+ * Write bootdata read from @stream to the load window, one window at most at a
+ * time.
+ *
+ * The upload is only verified as a whole by the final SIP_CHECKSUM, a mismatch
+ * power cycles the AP1302 and uploads the whole bootdata again. Verifying and
+ * resending single windows would require computing the SIP_CRC references on
+ * the host and rewinding SIP_CRC, neither the CRC algorithm nor the
+ * writability of SIP_CRC are documented.
+ */
+static int ap1302_write_fw_window(struct ap1302_dev *sensor,
+                  struct ap1302_fw_stream *stream, u32 len,
+                  unsigned int *win_pos, u32 burst_len)
+{
+    const u8 *buf;
+    int ret;
+
+    while (len) {
+        u32 offset = *win_pos % AP1302_FW_WINDOW_SIZE;
+        u32 size = min_t(u32, len, AP1302_FW_WINDOW_SIZE - offset);
+
+        ret = ap1302_fw_stream_read(stream, &buf, size);
+        if (ret >= 0 && ret < size)
+            ret = -EINVAL;
+        if (ret < 0)
+            return ret;
+
+        ret = ap1302_write_fw_block(sensor, buf, size, win_pos, burst_len);
+        if (ret) {
+            dev_err(sensor->dev, "%s: error = %d\n", __func__, ret);
+            return ret;
+        }
+
+        len -= size;
+    }
+
+    return 0;
+}
+
+/*
+ * Set the bootdata stage to 2 to apply the PLL initialization settings loaded
+ * at the beginning of the bootdata, and wait for the PLL to lock.
+ */
+static int ap1302_lock_pll(struct ap1302_dev *sensor)
+{
+    ktime_t start = ktime_get();
+    int ret;
+
+    ret = ap1302_write(sensor, AP1302_BOOTDATA_STAGE, 0x0002, NULL);
+    if (!ret)
+        ret = ap1302_poll(sensor, AP1302_WAIT_PLL_LOCK, AP1302_SYS_START,
+                          AP1302_SYS_START_PLL_LOCK,
+                          AP1302_SYS_START_PLL_LOCK, NULL);
+
+    ap1302_boot_phase(sensor, AP1302_PHASE_PLL_LOCK, start, 0, ret);
+    return ret;
+}
+
+/*
+ * Signal the end of the bootdata to the AP1302 and verify that it has been
+ * received correctly.
+ */
+static int ap1302_finish_bootdata(struct ap1302_dev *sensor)
+{
+    ktime_t start = ktime_get();
+    u32 crc = 0;
+    int ret;
+
+    /*
+     * Write 0xffff to the bootdata_stage register to indicate to the
+     * AP1302 that the whole bootdata content has been loaded.
+     */
+    ret = ap1302_write(sensor, AP1302_BOOTDATA_STAGE, 0xffff, NULL);
+    if (ret)
+        return ret;
+
+    /* A checksum that doesn't read back 0xffff in time is a mismatch. */
+    ret = __ap1302_poll(sensor, AP1302_WAIT_BOOTDATA, AP1302_SIP_CHECKSUM,
+                        0xffff, 0xffff, &crc);
+    if (ret == -ETIMEDOUT) {
+        dev_dbg(sensor->dev, "Timeout waiting for %s (0x%04x)\n",
+                ap1302_waits[AP1302_WAIT_BOOTDATA].name, crc);
+        ret = -EAGAIN;
+    }
+
+    ap1302_boot_phase(sensor, AP1302_PHASE_CHECKSUM, start, 0, ret);
+    if (ret == -EAGAIN)
+        dev_warn(sensor->dev,
+             "CRC mismatch: expected 0x%04x, got 0x%04x\n",
+             0xffff, crc);
+    if (ret)
+        return ret;
+
+    /* Adjust MIPI TCLK timings */
+    start = ktime_get();
+    ret = ap1302_set_mipi_t3_clk(sensor);
+    ap1302_boot_phase(sensor, AP1302_PHASE_MIPI_T3_CLK, start, 0, ret);
+
+    return ret;
+}
+
+/*
+ * Copy @size bytes from @src to @dst with the AP1302 DMA engine. @ctrl selects
+ * the source and destination memories.
+ */
+static int ap1302_dma_copy(struct ap1302_dev *sensor, u32 src, u32 dst,
+                           u32 size, u32 ctrl)
+{
+    int ret = 0;
+
+    ap1302_write(sensor, AP1302_DMA_SRC, src, &ret);
+    ap1302_write(sensor, AP1302_DMA_DST, dst, &ret);
+    ap1302_write(sensor, AP1302_DMA_SIZE, size, &ret);
+    ap1302_write(sensor, AP1302_DMA_CTRL,
+                 ctrl | AP1302_DMA_CTRL_SCH_NOW | AP1302_DMA_CTRL_MODE_COPY,
+                 &ret);
+    if (ret)
+        return ret;
+
+    return ap1302_poll(sensor, AP1302_WAIT_DMA, AP1302_DMA_CTRL,
+                       AP1302_DMA_CTRL_MODE_MASK, AP1302_DMA_CTRL_MODE_IDLE,
+                       NULL);
+}
+
+/*
+ * Compare the firmware image stored in the SPI flash with the one loaded
+ * from the filesystem, using the image size and bootdata CRC.
+ */
+static int ap1302_spi_flash_check(struct ap1302_dev *sensor, bool *match)
+{
+    const u32 staging = AP1302_REG_ADDR(AP1302_CON_BUF(0));
+    struct ap1302_flash_header hdr;
+    int ret;
+
+    ret = ap1302_dma_copy(sensor, AP1302_SPI_FW_OFFSET, staging, sizeof(hdr),
+                          AP1302_DMA_CTRL_SRC_SPI | AP1302_DMA_CTRL_DST_REG);
+    if (ret)
+        return ret;
+
+    ret = ap1302_read_raw(sensor, staging, &hdr, sizeof(hdr));
+    if (ret)
+        return ret;
+
+    *match = le32_to_cpu(hdr.size) ==
+             sizeof(sensor->fw_hdr) + sensor->fw_size &&
+             !memcmp(&hdr.fw, &sensor->fw_hdr, sizeof(hdr.fw));
+
+    return 0;
+}
+
+static int ap1302_dma_fw_window(struct ap1302_dev *sensor, u32 *flash_addr,
+                                u32 len, unsigned int *win_pos)
+{
+    int ret;
+
+    while (len) {
+        u32 offset = *win_pos % AP1302_FW_WINDOW_SIZE;
+        u32 size = min_t(u32, len, AP1302_FW_WINDOW_SIZE - offset);
 
-    if (fw_hdr->pll_init_size > fw_size) {
-        dev_err(sensor->dev, "Invalid firmware: PLL init size too large\n");
-        return -EINVAL;
+        ret = ap1302_dma_copy(sensor, *flash_addr,
+                              AP1302_FW_WINDOW_OFFSET + offset, size,
+                              AP1302_DMA_CTRL_SRC_SPI |
+                              AP1302_DMA_CTRL_DST_REG);
+        if (ret)
+            return ret;
+
+        *flash_addr += size;
+        *win_pos += size;
+        len -= size;
     }
 
     return 0;
 }
 
 /*
- * ap1302_write_fw_window() - Write a piece of firmware to the AP1302
- * @win_pos: Firmware load window current position
- * @buf: Firmware data buffer
- * @len: Firmware data length
+ * Load the bootdata from the SPI flash attached to the AP1302. The DMA engine
+ * copies the bootdata to the firmware load window the same way the host does
+ * over I2C, without any bootdata transfer on the I2C bus.
  *
- * The firmware is loaded through a window in the registers space. Writes are
- * sequential starting at address 0x8000, and must wrap around when reaching
- * 0x9fff. This function write the firmware data stored in @buf to the AP1302,
- * keeping track of the window position in the @win_pos argument.
+ * The flash isn't programmed by the driver, erasing its sectors through the
+ * AP1302 isn't documented. A stored image that doesn't match the firmware file
+ * is reported as an error, for the caller to fall back to the I2C upload.
  */
- 
-static int ap1302_write_fw_block(struct ap1302_dev *sensor, const u8 *buf,
-                  u32 len, unsigned int *win_pos) {
-    u32 block_num = len / AP1302_FW_BLOCK_LEN;
-    u32 last_block_size = len % AP1302_FW_BLOCK_LEN;
-    int i;
+static int ap1302_load_firmware_spi(struct ap1302_dev *sensor)
+{
+    const struct ap1302_firmware_header *fw_hdr = &sensor->fw_hdr;
+    u32 flash_addr = AP1302_SPI_FW_OFFSET +
+                     sizeof(struct ap1302_flash_header) +
+                     sizeof(struct ap1302_firmware_header);
+    u32 fw_size = sensor->fw_size;
+    unsigned int win_pos = 0;
+    bool match = false;
+    ktime_t start;
     int ret;
-    unsigned int wr_pos = *win_pos;
-    unsigned int write_addr;
 
-    for(i=0; i<block_num; i++) {
-        write_addr = wr_pos%AP1302_FW_WINDOW_SIZE + AP1302_FW_WINDOW_OFFSET;
-        ret = regmap_raw_write(sensor->regmap16, write_addr, buf, AP1302_FW_BLOCK_LEN);
-        if (ret) {
-            dev_err(sensor->dev, "%s: regmap_raw_write error = %d\n", __func__, ret);
-            return ret;
-        }
-        buf += AP1302_FW_BLOCK_LEN;
-        wr_pos += AP1302_FW_BLOCK_LEN;
+    start = ktime_get();
+    ret = ap1302_spi_flash_check(sensor, &match);
+    if (!ret && !match) {
+        dev_info(sensor->dev,
+                 "SPI flash image doesn't match the firmware file\n");
+        ret = -ENODATA;
     }
-    write_addr = wr_pos%AP1302_FW_WINDOW_SIZE + AP1302_FW_WINDOW_OFFSET;
-    if(last_block_size > 0) {
-        ret = regmap_raw_write(sensor->regmap16, write_addr, buf, last_block_size);
-        if (ret) {
-            dev_err(sensor->dev, "%s: regmap_raw_write error = %d\n", __func__, ret);
+    ap1302_boot_phase(sensor, AP1302_PHASE_SPI_FLASH, start, 0, ret);
+    if (ret)
+        return ret;
+
+    if (fw_hdr->pll_init_size) {
+        start = ktime_get();
+        ret = ap1302_dma_fw_window(sensor, &flash_addr,
+                                   fw_hdr->pll_init_size, &win_pos);
+        ap1302_boot_phase(sensor, AP1302_PHASE_PLL_UPLOAD, start,
+                          fw_hdr->pll_init_size, ret);
+        if (ret)
+            return ret;
+
+        ret = ap1302_lock_pll(sensor);
+        if (ret)
             return ret;
-        }
-        wr_pos += last_block_size;
     }
 
-    *win_pos = wr_pos;
+    start = ktime_get();
+    ret = ap1302_dma_fw_window(sensor, &flash_addr,
+                               fw_size - fw_hdr->pll_init_size, &win_pos);
+    ap1302_boot_phase(sensor, AP1302_PHASE_UPLOAD, start,
+                      fw_size - fw_hdr->pll_init_size, ret);
+    if (ret)
+        return ret;
+
+    ret = ap1302_finish_bootdata(sensor);
+    if (ret)
+        return ret;
+
+    /* Only report the SPI flash as the boot source once it has booted. */
+    sensor->boot_stats.spi_boot = true;
+
     return 0;
 }
 
-static int ap1302_write_fw_window(struct ap1302_dev *sensor, const u8 *buf,
-                  u32 len, unsigned int *win_pos)
+static void ap1302_log_upload(struct ap1302_dev *sensor, const char *phase,
+                              u32 size, ktime_t start, u32 burst_len)
 {
-    u32 block_num = len / AP1302_FW_WINDOW_SIZE;
-    u32 last_block_size = len % AP1302_FW_WINDOW_SIZE; 
-    int i;
-    int ret;
-    
-    for(i=0;i<block_num;i++) {
-        ret = ap1302_write_fw_block(sensor, buf, AP1302_FW_WINDOW_SIZE, win_pos);
-        if(ret) {
-            dev_err(sensor->dev, "%s: error = %d\n", __func__, ret);
-            return ret;
-        }
-        buf += AP1302_FW_WINDOW_SIZE;
-    }
-    if(last_block_size>0) {
-        ret = ap1302_write_fw_block(sensor, buf, last_block_size, win_pos);
-        if (ret) {
-            dev_err(sensor->dev, "%s: error = %d\n", __func__, ret);
-            return ret;
-        }
-    }
- 
-    return ret;
+    s64 elapsed_us = max_t(s64, ktime_us_delta(ktime_get(), start), 1);
+
+    dev_info(sensor->dev,
+             "Bootdata %s: %u bytes in %lld us (%llu B/s, %u-byte bursts)\n",
+             phase, size, elapsed_us,
+             div64_u64((u64)size * USEC_PER_SEC, elapsed_us), burst_len);
 }
 
 static int ap1302_load_firmware(struct ap1302_dev *sensor)
 {
-    const struct ap1302_firmware_header *fw_hdr;
-    unsigned int fw_size;
+    const struct ap1302_firmware_header *fw_hdr = &sensor->fw_hdr;
+    unsigned int fw_size = sensor->fw_size;
+    struct ap1302_fw_stream stream;
     const u8 *fw_data;
     unsigned int win_pos = 0;
-    unsigned int crc;
+    u32 pll_burst_len;
+    ktime_t start;
     int ret;
 
-    fw_hdr = (const struct ap1302_firmware_header *)sensor->fw->data;
-    fw_data = (u8 *)&fw_hdr[1];
-    fw_size = sensor->fw->size - sizeof(struct ap1302_firmware_header);
+    if (sensor->spi_boot) {
+        ret = ap1302_load_firmware_spi(sensor);
+        if (!ret)
+            return 0;
+
+        /*
+         * The load window may hold partial bootdata, power cycle and fall
+         * back to the I2C upload.
+         */
+        dev_warn(sensor->dev,
+                 "SPI flash boot failed (%d), falling back to I2C upload\n",
+                 ret);
+        sensor->spi_boot = false;
+        return -EAGAIN;
+    }
 
-    ret = ap1302_write_fw_window(sensor, fw_data, fw_size,
-                     &win_pos);
+    /* Skip the header, the bootdata follows. */
+    ret = ap1302_fw_stream_open(sensor, &stream);
     if (ret)
         return ret;
 
+    ret = ap1302_fw_stream_read(&stream, &fw_data, sizeof(*fw_hdr));
+    if (ret < 0)
+        goto done;
+
     /*
-     * Write 0xffff to the bootdata_stage register to indicate to the
-     * AP1302 that the whole bootdata content has been loaded.
-     */    
-    ret = ap1302_write(sensor, AP1302_BOOTDATA_STAGE, 0xffff, NULL);
-    usleep_range(40*1000, 80*1000);
-    ret |= ap1302_read(sensor, AP1302_SIP_CHECKSUM, &crc);
-    if (ret)
-        return ret;
+     * Load the PLL initialization settings first. The AP1302 runs from the
+     * external clock until its PLL locks, keep bursts conservative.
+     */
+    if (fw_hdr->pll_init_size) {
+        pll_burst_len = min_t(u32, sensor->fw_burst_len,
+                              AP1302_FW_BLOCK_LEN);
+
+        start = ktime_get();
+        ret = ap1302_write_fw_window(sensor, &stream, fw_hdr->pll_init_size,
+                                     &win_pos, pll_burst_len);
+        ap1302_boot_phase(sensor, AP1302_PHASE_PLL_UPLOAD, start,
+                          fw_hdr->pll_init_size, ret);
+        if (ret)
+            goto done;
 
-    if (crc != 0xffff) {
-        dev_warn(sensor->dev,
-             "CRC mismatch: expected 0x%04x, got 0x%04x\n",
-             0xffff, crc);
-        return -EAGAIN;
+        ret = ap1302_lock_pll(sensor);
+        if (ret)
+            goto done;
+
+        ap1302_log_upload(sensor, "PLL init", fw_hdr->pll_init_size, start,
+                          pll_burst_len);
     }
 
-    /* Adjust MIPI TCLK timings */
-    return ap1302_set_mipi_t3_clk(sensor);
+    /* Load the rest of the bootdata at full burst size. */
+    start = ktime_get();
+    ret = ap1302_write_fw_window(sensor, &stream,
+                                 fw_size - fw_hdr->pll_init_size, &win_pos,
+                                 sensor->fw_burst_len);
+    ap1302_boot_phase(sensor, AP1302_PHASE_UPLOAD, start,
+                      fw_size - fw_hdr->pll_init_size, ret);
+    if (ret)
+        goto done;
+
+    ap1302_log_upload(sensor, "upload", fw_size - fw_hdr->pll_init_size,
+                      start, sensor->fw_burst_len);
+
+    ret = ap1302_finish_bootdata(sensor);
+
+done:
+    ap1302_fw_stream_close(&stream);
+    return ret;
 }
 
 
-static int ap1302_hw_init(struct ap1302_dev *sensor)
+/*
+ * Cold boot the AP1302: take it out of reset and upload the bootdata, retrying
+ * in case of CRC errors. The AP1302 is reset with a full power cycle between
+ * each attempt. The supplies and clock must be enabled.
+ */
+static int ap1302_boot_firmware(struct ap1302_dev *sensor)
 {
     unsigned int retries;
+    ktime_t start;
     int ret;
 
-    /* Request and validate the firmware. */
-    ret = ap1302_request_firmware(sensor);
-    if (ret)
-        return ret;
-
-    /*
-     * Power the sensors first, as the firmware will access them once it
-     * gets loaded.
-     */
-    ret = ap1302_set_power_on(sensor);
-    if (ret < 0)
-        goto error_firmware;
-
-    /*
-     * Load the firmware, retrying in case of CRC errors. The AP1302 is
-     * reset with a full power cycle between each attempt.
-     */
     for (retries = 0; retries < MAX_FW_LOAD_RETRIES; ++retries) {
+        sensor->boot_stats.retries = retries;
+
+        start = ktime_get();
         ret = ap1302_power_on(sensor);
+        ap1302_boot_phase(sensor, AP1302_PHASE_POWER_ON, start, 0, ret);
         if (ret < 0)
-            goto error_power;
+            return ret;
 
+        start = ktime_get();
         ret = ap1302_detect_chip(sensor);
+        ap1302_boot_phase(sensor, AP1302_PHASE_DETECT, start, 0, ret);
         if (ret)
-            goto error_power;
+            return ret;
 
         ret = ap1302_load_firmware(sensor);
         if (!ret)
-            break;
+            return ap1302_sync_regs(sensor);
 
         if (ret != -EAGAIN)
-            goto error_power;
+            return ret;
 
         ap1302_power_off(sensor);
     }
 
-    if (retries == MAX_FW_LOAD_RETRIES) {
-        dev_err(sensor->dev, "Firmware load retries exceeded, aborting\n");
-        ret = -ETIMEDOUT;
+    dev_err(sensor->dev, "Firmware load retries exceeded, aborting\n");
+    return -ETIMEDOUT;
+}
+
+/*
+ * Bring the AP1302 up with the firmware held in sensor->fw. The firmware is
+ * released on failure.
+ */
+static int ap1302_boot(struct ap1302_dev *sensor)
+{
+    int ret;
+
+    /*
+     * Power the sensors first, as the firmware will access them once it
+     * gets loaded.
+     */
+    ret = ap1302_set_power_on(sensor);
+    if (ret < 0)
+        goto error_firmware;
+
+    ret = ap1302_boot_firmware(sensor);
+    if (ret)
         goto error_power;
-    }
 
     return 0;
 
 error_power:
     ap1302_set_power_off(sensor);
 error_firmware:
-    release_firmware(sensor->fw);
+    ap1302_release_firmware(sensor);
 
     return ret;
 }
 
+static void ap1302_boot_work(struct work_struct *work)
+{
+    struct ap1302_dev *sensor = container_of(work, struct ap1302_dev,
+                                             boot_work);
+    int ret;
+
+    ap1302_boot_start(sensor);
+
+    /*
+     * In asynchronous mode this already runs off the probe path, the
+     * firmware is requested synchronously from the worker instead of with
+     * request_firmware_nowait() to go through the shared firmware cache.
+     */
+    ret = ap1302_request_firmware(sensor);
+    ap1302_boot_phase(sensor, AP1302_PHASE_FW_REQUEST,
+                      sensor->boot_stats.start,
+                      ret ? 0 : sensor->fw->size, ret);
+    if (!ret) {
+        ap1302_load_scripts(sensor);
+        ret = ap1302_boot(sensor);
+    }
+
+    ap1302_boot_end(sensor, ret);
+    if (!ret && async_boot)
+        dev_info(sensor->dev, "ap1302 ISP is ready\n");
+
+    sensor->boot_ret = ret;
+    complete_all(&sensor->boot_done);
+}
+
+static int ap1302_hw_init(struct ap1302_dev *sensor)
+{
+    /*
+     * Boot on an unbound worker to keep the power-up and upload of multiple
+     * devices independent from each other.
+     */
+    if (async_boot) {
+        queue_work(system_unbound_wq, &sensor->boot_work);
+        return 0;
+    }
+
+    ap1302_boot_work(&sensor->boot_work);
+
+    return sensor->boot_ret;
+}
+
 static void ap1302_hw_cleanup(struct ap1302_dev *sensor)
 {
+    int ret;
+
+    /* Let a pending asynchronous boot finish before tearing down. */
+    ret = ap1302_wait_boot(sensor);
+    flush_work(&sensor->boot_work);
+    if (ret)
+        return;
+
     ap1302_set_power_off(sensor);
+    ap1302_release_firmware(sensor);
+}
+
+/* -----------------------------------------------------------------------------
+ * Debugfs
+ */
+
+static int ap1302_boot_show(struct seq_file *s, void *unused)
+{
+    struct ap1302_dev *sensor = s->private;
+    const struct ap1302_boot_stats *stats = &sensor->boot_stats;
+    unsigned int i;
+
+    if (!completion_done(&sensor->boot_done)) {
+        seq_puts(s, "boot in progress\n");
+        return 0;
+    }
+
+    seq_printf(s, "result: %d\n", stats->ret);
+    seq_printf(s, "duration: %lld us\n", stats->duration_us);
+    seq_printf(s, "source: %s\n", stats->spi_boot ? "spi flash" : "i2c");
+    seq_printf(s, "retries: %u\n", stats->retries);
+
+    seq_puts(s, "\nphase          duration (us)      bytes\n");
+    for (i = 0; i < AP1302_NUM_PHASES; ++i)
+        seq_printf(s, "%-14s %13lld %10u\n", ap1302_phase_names[i],
+                   stats->phase_us[i], stats->phase_bytes[i]);
+
+    seq_puts(s, "\nwait                last (us)   max (us)\n");
+    for (i = 0; i < AP1302_NUM_WAITS; ++i)
+        seq_printf(s, "%-18s %10u %10u\n", ap1302_waits[i].name,
+                   sensor->wait_us[i], sensor->wait_max_us[i]);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ap1302_boot);
+
+static int ap1302_reg_stats_show(struct seq_file *s, void *unused)
+{
+    struct ap1302_dev *sensor = s->private;
+    struct ap1302_stats *stats = &sensor->stats;
+    struct ap1302_reg_stats *rs;
+    unsigned long index;
+    unsigned int i;
+
+    mutex_lock(&stats->lock);
+
+    seq_printf(s, "page switches: %u\n", sensor->page_switches);
+    seq_printf(s, "untracked accesses: %llu\n", stats->untracked);
+
+    seq_puts(s, "\nregister       reads     writes      bytes   errors\n");
+    xa_for_each(&stats->regs, index, rs)
+        seq_printf(s, "0x%06lx/%u %10llu %10llu %10llu %8llu\n",
+                   index & 0x00ffffff,
+                   (unsigned int)AP1302_REG_SIZE(index) * 8,
+                   rs->reads, rs->writes, rs->bytes, rs->errors);
+
+    seq_puts(s, "\nlatency (ns)                  count\n");
+    for (i = 0; i < AP1302_STATS_LAT_BUCKETS; ++i) {
+        if (!stats->latency[i])
+            continue;
+        seq_printf(s, "%10llu - %10llu %10llu\n", i ? 1ULL << i : 0,
+                   (1ULL << (i + 1)) - 1, stats->latency[i]);
+    }
+
+    mutex_unlock(&stats->lock);
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ap1302_reg_stats);
+
+static int ap1302_reg_stats_reset(void *data, u64 val)
+{
+    struct ap1302_dev *sensor = data;
+
+    ap1302_stats_reset(sensor);
+
+    return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(ap1302_reg_stats_reset_fops, NULL,
+                         ap1302_reg_stats_reset, "%llu\n");
+
+static int ap1302_regs_show(struct seq_file *s, void *unused)
+{
+    struct ap1302_dev *sensor = s->private;
+    struct ap1302_batch *batch = &sensor->batch;
+    const u32 *pc, *end;
+    unsigned int i = 0;
+
+    mutex_lock(&sensor->lock);
+
+    if (!batch->run) {
+        seq_puts(s, "result: not run\n");
+        goto unlock;
+    }
+
+    seq_printf(s, "result: %d\n", batch->ret);
+    if (batch->ret)
+        goto unlock;
+
+    pc = batch->script.data;
+    end = pc + batch->script.len;
+
+    while (pc < end) {
+        unsigned int op = AP1302_SCRIPT_OPCODE(*pc);
+        u32 reg = AP1302_SCRIPT_ARG(*pc);
+
+        if (op == AP1302_SCRIPT_OP_READ)
+            seq_printf(s, "r%u 0x%06x 0x%0*x\n", AP1302_REG_SIZE(reg) * 8,
+                       reg & 0x00ffffff, AP1302_REG_SIZE(reg) * 2,
+                       batch->reads[i++]);
+
+        pc += 1 + ap1302_script_operands[op];
+        if (op == AP1302_SCRIPT_OP_BULK)
+            pc += *(pc - 1);
+    }
+
+unlock:
+    mutex_unlock(&sensor->lock);
+    return 0;
+}
+
+static int ap1302_regs_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, ap1302_regs_show, inode->i_private);
+}
+
+/*
+ * Writing a batch replaces the previous one and runs it if the sensor is
+ * powered. Reading returns the result and the values read by the last run.
+ */
+static ssize_t ap1302_regs_write(struct file *file, const char __user *ubuf,
+                                 size_t count, loff_t *ppos)
+{
+    struct seq_file *s = file->private_data;
+    struct ap1302_dev *sensor = s->private;
+    char *buf;
+    int ret;
+
+    if (*ppos || count > AP1302_BATCH_MAX_SIZE)
+        return -EINVAL;
+
+    buf = memdup_user_nul(ubuf, count);
+    if (IS_ERR(buf))
+        return PTR_ERR(buf);
+
+    ret = ap1302_wait_boot(sensor);
+    if (ret)
+        goto done;
+
+    mutex_lock(&sensor->lock);
+
+    ret = ap1302_batch_parse(sensor, buf);
+    if (!ret && sensor->power_count)
+        ret = ap1302_batch_run(sensor);
+
+    mutex_unlock(&sensor->lock);
+
+done:
+    kfree(buf);
+    return ret ? ret : count;
+}
+
+static const struct file_operations ap1302_regs_fops = {
+    .owner = THIS_MODULE,
+    .open = ap1302_regs_open,
+    .read = seq_read,
+    .write = ap1302_regs_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void ap1302_debugfs_init(struct ap1302_dev *sensor)
+{
+    char name[32];
+
+    snprintf(name, sizeof(name), "ap1302-%s", dev_name(sensor->dev));
+
+    sensor->debugfs = debugfs_create_dir(name, NULL);
+    debugfs_create_file("boot", 0444, sensor->debugfs, sensor,
+                        &ap1302_boot_fops);
+    debugfs_create_u32("page_switches", 0444, sensor->debugfs,
+                       &sensor->page_switches);
+    debugfs_create_file("reg_stats", 0444, sensor->debugfs, sensor,
+                        &ap1302_reg_stats_fops);
+    debugfs_create_file_unsafe("reg_stats_reset", 0200, sensor->debugfs,
+                               sensor, &ap1302_reg_stats_reset_fops);
+    debugfs_create_file("regs", 0600, sensor->debugfs, sensor,
+                        &ap1302_regs_fops);
+    debugfs_create_bool("regs_replay", 0600, sensor->debugfs,
+                        &sensor->batch.replay);
+}
+
+static void ap1302_debugfs_cleanup(struct ap1302_dev *sensor)
+{
+    debugfs_remove_recursive(sensor->debugfs);
 }
 
 static int ap1302_probe(struct i2c_client *client)
@@ -2203,7 +5511,9 @@ static int ap1302_probe(struct i2c_client *client)
     struct device *dev = &client->dev;
     struct fwnode_handle *endpoint;
     struct ap1302_dev *sensor;
+    struct ap1302_context *ctx;
     struct v4l2_mbus_framefmt *fmt;
+    unsigned int i;
     u32 rotation;
     int ret;
 
@@ -2214,27 +5524,30 @@ static int ap1302_probe(struct i2c_client *client)
     sensor->i2c_client = client;
     sensor->dev = dev;
 
-    sensor->regmap16 = devm_regmap_init_i2c(client, &ap1302_reg16_config);
-    if (IS_ERR(sensor->regmap16)) {
-        dev_err(dev, "regmap16 init failed: %ld\n",
-        PTR_ERR(sensor->regmap16));
-        ret = -ENODEV;
-        return ret;
-    }
+    mutex_init(&sensor->stats.lock);
+    xa_init(&sensor->stats.regs);
 
-    sensor->regmap32 = devm_regmap_init_i2c(client, &ap1302_reg32_config);
-    if (IS_ERR(sensor->regmap32)) {
-        dev_err(dev, "regmap32 init failed: %ld\n",
-        PTR_ERR(sensor->regmap32));
+    ap1302_xfer_init(sensor);
+
+    sensor->regmap = devm_regmap_init(dev, &ap1302_regmap_bus, sensor,
+                                      &ap1302_reg_config);
+    if (IS_ERR(sensor->regmap)) {
+        dev_err(dev, "regmap init failed: %ld\n",
+        PTR_ERR(sensor->regmap));
         ret = -ENODEV;
         return ret;
     }
 
+    sensor->fw_burst_len = ap1302_fw_burst_len(sensor);
+    dev_dbg(dev, "Firmware upload burst length %u bytes\n",
+            sensor->fw_burst_len);
+
     /*
      * default init sequence initialize sensor to
      * YUV422 UYVY VGA@30fps
      */
-    fmt = &sensor->fmt;
+    ctx = &sensor->contexts[AP1302_CTX_PREVIEW];
+    fmt = &ctx->fmt;
     fmt->code = MEDIA_BUS_FMT_UYVY8_1X16;
     fmt->colorspace = V4L2_COLORSPACE_SRGB;
     fmt->ycbcr_enc = V4L2_MAP_YCBCR_ENC_DEFAULT(fmt->colorspace);
@@ -2243,15 +5556,16 @@ static int ap1302_probe(struct i2c_client *client)
     fmt->width = 3840;
     fmt->height = 2160;
     fmt->field = V4L2_FIELD_NONE;
-    sensor->frame_interval.numerator = 1;
-    sensor->frame_interval.denominator = ap1302_framerates[AP1302_30_FPS];
-    sensor->current_fr = AP1302_30_FPS;
-    sensor->current_mode =
-        &ap1302_mode_data[AP1302_MODE_4K_3840_2160];
-    sensor->last_mode = sensor->current_mode;
+    ctx->frame_interval.numerator = 1;
+    ctx->frame_interval.denominator = AP1302_DEFAULT_FPS;
+    sensor->ctx = ctx;
 
     sensor->ae_target = 52;
 
+    /* boot from the SPI flash attached to the AP1302 */
+    sensor->spi_boot = fwnode_property_read_bool(dev_fwnode(sensor->dev),
+                                                 "onnn,spi-flash-boot");
+
     /* optional indication of physical rotation of sensor */
     ret = fwnode_property_read_u32(dev_fwnode(sensor->dev), "rotation",
                        &rotation);
@@ -2275,13 +5589,18 @@ static int ap1302_probe(struct i2c_client *client)
         return -EINVAL;
     }
 
-    ret = v4l2_fwnode_endpoint_parse(endpoint, &sensor->ep);
+    ret = v4l2_fwnode_endpoint_alloc_parse(endpoint, &sensor->ep);
     fwnode_handle_put(endpoint);
     if (ret) {
         dev_err(dev, "Could not parse endpoint\n");
         return ret;
     }
 
+    /* The output link runs at a single frequency, use the first one. */
+    if (sensor->ep.nr_of_link_frequencies)
+        sensor->link_freq = sensor->ep.link_frequencies[0];
+    v4l2_fwnode_endpoint_free(&sensor->ep);
+
     if (sensor->ep.bus_type != V4L2_MBUS_PARALLEL &&
         sensor->ep.bus_type != V4L2_MBUS_CSI2_DPHY &&
         sensor->ep.bus_type != V4L2_MBUS_BT656) {
@@ -2289,6 +5608,27 @@ static int ap1302_probe(struct i2c_client *client)
         return -EINVAL;
     }
 
+    if (!sensor->link_freq) {
+        dev_err(dev, "link-frequencies property not found\n");
+        return -EINVAL;
+    }
+
+    if (sensor->ep.bus_type == V4L2_MBUS_CSI2_DPHY &&
+        sensor->link_freq * 2 > AP1302_MIPI_LANE_MAX_RATE) {
+        dev_err(dev, "Link frequency %llu Hz out of range\n",
+                sensor->link_freq);
+        return -EINVAL;
+    }
+
+    /* The mode bandwidth depends on the number of data lanes. */
+    ap1302_calc_mode(sensor, fmt->width, fmt->height, &ctx->mode);
+    ap1302_calc_interval(sensor, &ctx->mode, &ctx->frame_interval);
+    sensor->last_dn_mode = ctx->mode.dn_mode;
+
+    /* All contexts start with the same configuration. */
+    for (i = 1; i < AP1302_NUM_CONTEXTS; ++i)
+        sensor->contexts[i] = *ctx;
+
     /* get system clock (xclk) */
     sensor->xclk = devm_clk_get(dev, "xclk");
     if (IS_ERR(sensor->xclk)) {
@@ -2331,6 +5671,8 @@ static int ap1302_probe(struct i2c_client *client)
         return ret;
 
     mutex_init(&sensor->lock);
+    init_completion(&sensor->boot_done);
+    INIT_WORK(&sensor->boot_work, ap1302_boot_work);
 
     ret = ap1302_init_controls(sensor);
     if (ret)
@@ -2340,20 +5682,29 @@ static int ap1302_probe(struct i2c_client *client)
     if (ret)
         goto free_ctrls;
 
+    ap1302_debugfs_init(sensor);
+
     ret = ap1302_hw_init(sensor);
     if (ret)
         goto unreg_dev;
-        
-    dev_info(dev, "ap1302 ISP is found\n");
+
+    if (async_boot)
+        dev_info(dev, "ap1302 ISP is booting asynchronously\n");
+    else
+        dev_info(dev, "ap1302 ISP is found\n");
     return 0;
 
 unreg_dev:
+    ap1302_release_scripts(sensor);
+    ap1302_debugfs_cleanup(sensor);
     v4l2_async_unregister_subdev(&sensor->sd);
 free_ctrls:
     v4l2_ctrl_handler_free(&sensor->ctrls.handler);
 entity_cleanup:
     mutex_destroy(&sensor->lock);
     media_entity_cleanup(&sensor->sd.entity);
+    ap1302_stats_reset(sensor);
+    mutex_destroy(&sensor->stats.lock);
     return ret;
 }
 
@@ -2361,11 +5712,15 @@ static int ap1302_remove(struct i2c_client *client)
 {
     struct v4l2_subdev *sd = i2c_get_clientdata(client);
     struct ap1302_dev *sensor = to_ap1302_dev(sd);
+    ap1302_debugfs_cleanup(sensor);
     ap1302_hw_cleanup(sensor);
+    ap1302_release_scripts(sensor);
     v4l2_async_unregister_subdev(&sensor->sd);
     media_entity_cleanup(&sensor->sd.entity);
     v4l2_ctrl_handler_free(&sensor->ctrls.handler);
     mutex_destroy(&sensor->lock);
+    ap1302_stats_reset(sensor);
+    mutex_destroy(&sensor->stats.lock);
 
     return 0;
 }
@@ -0,0 +1,741 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * AP1302 register-level simulator
+ *
+ * Registers a virtual I2C adapter with a model of the AP1302 behind it, to
+ * exercise and benchmark the ap1302 driver without the hardware. The model
+ * covers what the driver relies on to boot and stream:
+ *
+ * - the 16-bit register space, with address auto-increment and
+ *   I2C_M_NOSTART continuation
+ * - the bootdata load window, with the running SIP_CRC, BOOTDATA_STAGE PLL
+ *   lock and SIP_CHECKSUM verification
+ * - the paged advanced registers window selected by ADVANCED_BASE
+ * - SYS_START stall semantics and FRAME_CNT progression
+ * - DMA copies from an emulated, erased SPI flash to the registers
+ *
+ * An ap1302 client is instantiated on the adapter, with a software node
+ * describing its CSI-2 endpoint and a fixed rate clock registered as its
+ * "xclk", for the driver to probe as it would from the device tree.
+ *
+ * Bus latency and fault injection are configured through module parameters.
+ * The simulator has no reset line: reading CHIP_VERSION outside of a bootdata
+ * load, as the driver does after each power up, resets the boot state.
+ */
+
+#include <linux/clk-provider.h>
+#include <linux/clkdev.h>
+#include <linux/crc-itu-t.h>
+#include <linux/delay.h>
+#include <linux/i2c.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/property.h>
+#include <linux/random.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <asm/unaligned.h>
+#include <dt-bindings/media/video-interfaces.h>
+
+#define AP1302_SIM_CHIP_ID                  0x0265
+#define AP1302_SIM_CHIP_REV                 0x0206
+
+#define AP1302_SIM_CHIP_VERSION             0x0000
+#define AP1302_SIM_FRAME_CNT                0x0002
+#define AP1302_SIM_CHIP_REV_REG             0x0050
+#define AP1302_SIM_BOOTDATA_STAGE           0x6002
+#define AP1302_SIM_SYS_START                0x601a
+#define AP1302_SIM_SYS_START_PLL_LOCK       BIT(15)
+#define AP1302_SIM_SYS_START_STALL_STATUS   BIT(9)
+#define AP1302_SIM_SYS_START_STALL_EN       BIT(8)
+#define AP1302_SIM_DMA_SRC                  0x60a0
+#define AP1302_SIM_DMA_DST                  0x60a4
+#define AP1302_SIM_DMA_SIZE                 0x60a8
+#define AP1302_SIM_DMA_CTRL                 0x60ac
+#define AP1302_SIM_DMA_CTRL_DST(n)          (((n) >> 8) & 3)
+#define AP1302_SIM_DMA_CTRL_SRC(n)          (((n) >> 4) & 3)
+#define AP1302_SIM_DMA_CTRL_MEM_REG         0
+#define AP1302_SIM_DMA_CTRL_MEM_SPI         2
+#define AP1302_SIM_DMA_CTRL_MODE_MASK       (7 << 0)
+#define AP1302_SIM_DMA_CTRL_MODE_COPY       (2 << 0)
+#define AP1302_SIM_SIP_CHECKSUM             0x6134
+#define AP1302_SIM_FW_WINDOW                0x8000
+#define AP1302_SIM_FW_WINDOW_SIZE           0x2000
+#define AP1302_SIM_ADV_WINDOW               0xe000
+#define AP1302_SIM_ADV_WINDOW_SIZE          0x1000
+#define AP1302_SIM_ADV_NUM_PAGES            256
+#define AP1302_SIM_ADVANCED_BASE            0xf038
+#define AP1302_SIM_SIP_CRC                  0xf052
+
+#define AP1302_SIM_REG_SPACE                0x10000
+
+static unsigned short addr = 0x3c;
+module_param(addr, ushort, 0444);
+MODULE_PARM_DESC(addr, "I2C address of the simulated AP1302, default 0x3c");
+
+static bool nostart = true;
+module_param(nostart, bool, 0444);
+MODULE_PARM_DESC(nostart, "Advertise I2C_M_NOSTART support, default 1");
+
+static unsigned int max_write_len;
+module_param(max_write_len, uint, 0444);
+MODULE_PARM_DESC(max_write_len,
+         "Maximum write message length quirk in bytes, default 0 (none)");
+
+static unsigned int xfer_latency_us = 50;
+module_param(xfer_latency_us, uint, 0644);
+MODULE_PARM_DESC(xfer_latency_us, "Latency of each transfer in us, default 50");
+
+static unsigned int byte_ns = 25000;
+module_param(byte_ns, uint, 0644);
+MODULE_PARM_DESC(byte_ns,
+         "Time to transfer one byte in ns, default 25000 (400 kHz)");
+
+static unsigned int pll_lock_us = 1000;
+module_param(pll_lock_us, uint, 0644);
+MODULE_PARM_DESC(pll_lock_us, "PLL lock time in us, default 1000");
+
+static unsigned int boot_us = 20000;
+module_param(boot_us, uint, 0644);
+MODULE_PARM_DESC(boot_us, "Bootdata verification time in us, default 20000");
+
+static unsigned int stall_us = 33000;
+module_param(stall_us, uint, 0644);
+MODULE_PARM_DESC(stall_us, "Time to stall the pipeline in us, default 33000");
+
+static unsigned int dma_ns_per_byte = 100;
+module_param(dma_ns_per_byte, uint, 0644);
+MODULE_PARM_DESC(dma_ns_per_byte, "DMA copy time per byte in ns, default 100");
+
+static unsigned int fps = 30;
+module_param(fps, uint, 0644);
+MODULE_PARM_DESC(fps, "Frame rate of FRAME_CNT progression, default 30");
+
+static unsigned int nak_rate;
+module_param(nak_rate, uint, 0644);
+MODULE_PARM_DESC(nak_rate, "Transfers failing with -EIO, per million");
+
+static unsigned int corrupt_rate;
+module_param(corrupt_rate, uint, 0644);
+MODULE_PARM_DESC(corrupt_rate,
+         "Bootdata writes corrupted on the bus, per million");
+
+static unsigned int flash_size = SZ_4M;
+module_param(flash_size, uint, 0444);
+MODULE_PARM_DESC(flash_size, "Emulated SPI flash size in bytes, default 4M");
+
+static unsigned int xclk_rate = 24000000;
+module_param(xclk_rate, uint, 0444);
+MODULE_PARM_DESC(xclk_rate, "Rate of the AP1302 xclk in Hz, default 24000000");
+
+static unsigned int data_lanes = 4;
+module_param(data_lanes, uint, 0444);
+MODULE_PARM_DESC(data_lanes, "Number of CSI-2 data lanes (1, 2 or 4), default 4");
+
+enum ap1302_sim_state {
+    AP1302_SIM_RESET,
+    AP1302_SIM_LOADING,
+    AP1302_SIM_VERIFYING,
+    AP1302_SIM_BOOTED,
+    AP1302_SIM_FAILED,
+};
+
+struct ap1302_sim {
+    struct i2c_adapter adapter;
+    struct i2c_adapter_quirks quirks;
+    struct i2c_client *client;
+    struct clk_hw *xclk;
+    struct clk_lookup *xclk_lookup;
+    struct mutex lock;
+
+    u8 regs[AP1302_SIM_REG_SPACE]; /* big endian register contents */
+    u8 *adv; /* advanced registers, all pages */
+    u8 *flash;
+    u16 addr; /* current register address */
+
+    enum ap1302_sim_state state;
+    u16 crc; /* CRC of the bootdata as received */
+    u16 clean_crc; /* CRC of the bootdata as sent */
+
+    ktime_t pll_lock_at;
+    ktime_t boot_at;
+    ktime_t stall_at;
+    ktime_t dma_at;
+    bool pll_locking;
+    bool pll_locked;
+    bool stalling;
+    bool dma_busy;
+
+    ktime_t frame_start;
+    u16 frame_base;
+    bool running;
+
+    /* statistics */
+    u64 transfers;
+    u64 bytes;
+    u64 naks;
+    u64 corruptions;
+};
+
+static struct ap1302_sim *ap1302_sim;
+
+/*
+ * Firmware node of the simulated AP1302, with a single CSI-2 D-PHY endpoint.
+ * The data-lanes property length is set from the data_lanes parameter.
+ */
+static u32 ap1302_sim_data_lanes[] = { 1, 2, 3, 4 };
+static u64 ap1302_sim_link_freqs[] = { 750000000 };
+
+static struct property_entry ap1302_sim_ep_props[] = {
+    PROPERTY_ENTRY_U32("bus-type", MEDIA_BUS_TYPE_CSI2_DPHY),
+    PROPERTY_ENTRY_U32("clock-lanes", 0),
+    PROPERTY_ENTRY_U32_ARRAY("data-lanes", ap1302_sim_data_lanes),
+    PROPERTY_ENTRY_U64_ARRAY("link-frequencies", ap1302_sim_link_freqs),
+    { }
+};
+
+static const struct software_node ap1302_sim_node = {
+    .name = "ap1302-sim",
+};
+
+static const struct software_node ap1302_sim_port_node = {
+    .name = "port",
+    .parent = &ap1302_sim_node,
+};
+
+static const struct software_node ap1302_sim_ep_node = {
+    .name = "endpoint",
+    .parent = &ap1302_sim_port_node,
+    .properties = ap1302_sim_ep_props,
+};
+
+static const struct software_node *ap1302_sim_nodes[] = {
+    &ap1302_sim_node,
+    &ap1302_sim_port_node,
+    &ap1302_sim_ep_node,
+    NULL,
+};
+
+static bool ap1302_sim_chance(unsigned int rate)
+{
+    return rate && get_random_u32() % 1000000 < rate;
+}
+
+static u16 ap1302_sim_get16(struct ap1302_sim *sim, u16 reg)
+{
+    return get_unaligned_be16(&sim->regs[reg]);
+}
+
+static void ap1302_sim_set16(struct ap1302_sim *sim, u16 reg, u16 val)
+{
+    put_unaligned_be16(val, &sim->regs[reg]);
+}
+
+static bool ap1302_sim_touches(u16 start, unsigned int len, u16 reg,
+                               unsigned int size)
+{
+    return start < reg + size && reg < start + len;
+}
+
+static u8 *ap1302_sim_adv_page(struct ap1302_sim *sim)
+{
+    u32 base = get_unaligned_be32(&sim->regs[AP1302_SIM_ADVANCED_BASE]);
+
+    return sim->adv + ((base >> 16) % AP1302_SIM_ADV_NUM_PAGES) *
+           AP1302_SIM_ADV_WINDOW_SIZE;
+}
+
+static void ap1302_sim_reset(struct ap1302_sim *sim)
+{
+    sim->state = AP1302_SIM_RESET;
+    sim->crc = 0xffff;
+    sim->clean_crc = 0xffff;
+    sim->pll_locking = false;
+    sim->pll_locked = false;
+    sim->stalling = false;
+    sim->dma_busy = false;
+    sim->running = false;
+
+    ap1302_sim_set16(sim, AP1302_SIM_SYS_START, 0);
+    ap1302_sim_set16(sim, AP1302_SIM_SIP_CHECKSUM, 0);
+    ap1302_sim_set16(sim, AP1302_SIM_BOOTDATA_STAGE, 0);
+    ap1302_sim_set16(sim, AP1302_SIM_FRAME_CNT, 0);
+}
+
+/* -----------------------------------------------------------------------------
+ * Time-Dependent State
+ */
+
+static void ap1302_sim_start_frames(struct ap1302_sim *sim)
+{
+    sim->frame_start = ktime_get();
+    sim->frame_base = ap1302_sim_get16(sim, AP1302_SIM_FRAME_CNT);
+    sim->running = true;
+}
+
+static void ap1302_sim_update(struct ap1302_sim *sim)
+{
+    ktime_t now = ktime_get();
+    u16 sys_start = ap1302_sim_get16(sim, AP1302_SIM_SYS_START);
+
+    if (sim->pll_locking && ktime_after(now, sim->pll_lock_at)) {
+        sim->pll_locking = false;
+        sim->pll_locked = true;
+    }
+
+    if (sim->state == AP1302_SIM_VERIFYING && ktime_after(now, sim->boot_at)) {
+        /*
+         * The bootdata is intact if its CRC matches the CRC of the bytes
+         * as sent, wherever the corrupted bytes landed in the window.
+         */
+        bool ok = sim->crc == sim->clean_crc;
+
+        sim->state = ok ? AP1302_SIM_BOOTED : AP1302_SIM_FAILED;
+        ap1302_sim_set16(sim, AP1302_SIM_SIP_CHECKSUM, ok ? 0xffff : sim->crc);
+        if (ok)
+            ap1302_sim_start_frames(sim);
+    }
+
+    if (sim->stalling && ktime_after(now, sim->stall_at)) {
+        sys_start |= AP1302_SIM_SYS_START_STALL_STATUS;
+        sim->stalling = false;
+    }
+
+    if (sim->dma_busy && ktime_after(now, sim->dma_at)) {
+        u16 ctrl = ap1302_sim_get16(sim, AP1302_SIM_DMA_CTRL);
+
+        ap1302_sim_set16(sim, AP1302_SIM_DMA_CTRL,
+                         ctrl & ~AP1302_SIM_DMA_CTRL_MODE_MASK);
+        sim->dma_busy = false;
+    }
+
+    if (sim->pll_locked)
+        sys_start |= AP1302_SIM_SYS_START_PLL_LOCK;
+    ap1302_sim_set16(sim, AP1302_SIM_SYS_START, sys_start);
+
+    if (sim->running && fps) {
+        u64 frames = div_u64(ktime_us_delta(now, sim->frame_start) * fps,
+                             USEC_PER_SEC);
+
+        ap1302_sim_set16(sim, AP1302_SIM_FRAME_CNT,
+                         (u16)(sim->frame_base + frames));
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * Register Accesses
+ */
+
+/*
+ * Receive bootdata in the load window, accumulating the CRC of the received
+ * bytes, and of the bytes as sent to detect corruption.
+ */
+static void ap1302_sim_write_window(struct ap1302_sim *sim, u16 offset,
+                                    const u8 *data, unsigned int len)
+{
+    unsigned int i;
+
+    if (sim->state == AP1302_SIM_RESET)
+        sim->state = AP1302_SIM_LOADING;
+
+    for (i = 0; i < len; ++i) {
+        u8 byte = data[i];
+
+        sim->clean_crc = crc_itu_t(sim->clean_crc, &byte, 1);
+
+        if (ap1302_sim_chance(corrupt_rate)) {
+            byte ^= BIT(get_random_u32() % 8);
+            sim->corruptions++;
+        }
+
+        sim->crc = crc_itu_t(sim->crc, &byte, 1);
+    }
+}
+
+static void ap1302_sim_dma(struct ap1302_sim *sim, u16 ctrl)
+{
+    u32 src = get_unaligned_be32(&sim->regs[AP1302_SIM_DMA_SRC]);
+    u32 dst = get_unaligned_be32(&sim->regs[AP1302_SIM_DMA_DST]);
+    u32 size = get_unaligned_be32(&sim->regs[AP1302_SIM_DMA_SIZE]);
+    unsigned int src_mem = AP1302_SIM_DMA_CTRL_SRC(ctrl);
+    unsigned int dst_mem = AP1302_SIM_DMA_CTRL_DST(ctrl);
+    unsigned int mode = ctrl & AP1302_SIM_DMA_CTRL_MODE_MASK;
+    const u8 *from;
+    u8 *buf;
+
+    if (mode != AP1302_SIM_DMA_CTRL_MODE_COPY)
+        goto error;
+
+    if (src_mem == AP1302_SIM_DMA_CTRL_MEM_SPI) {
+        if (src >= flash_size || size > flash_size - src)
+            goto error;
+        from = &sim->flash[src];
+    } else if (src_mem == AP1302_SIM_DMA_CTRL_MEM_REG) {
+        if (src >= AP1302_SIM_REG_SPACE ||
+            size > AP1302_SIM_REG_SPACE - src)
+            goto error;
+        from = &sim->regs[src];
+    } else {
+        goto error;
+    }
+
+    if (dst_mem == AP1302_SIM_DMA_CTRL_MEM_REG &&
+        dst >= AP1302_SIM_FW_WINDOW &&
+        dst + size <= AP1302_SIM_FW_WINDOW + AP1302_SIM_FW_WINDOW_SIZE) {
+        /* The DMA bypasses the bus, copy out of the source first. */
+        buf = kmemdup(from, size, GFP_KERNEL);
+        if (!buf)
+            goto error;
+        ap1302_sim_write_window(sim, dst - AP1302_SIM_FW_WINDOW, buf, size);
+        kfree(buf);
+    } else if (dst_mem == AP1302_SIM_DMA_CTRL_MEM_REG &&
+               dst < AP1302_SIM_REG_SPACE &&
+               size <= AP1302_SIM_REG_SPACE - dst) {
+        memmove(&sim->regs[dst], from, size);
+    } else {
+        goto error;
+    }
+
+    sim->dma_at = ktime_add_ns(ktime_get(), (u64)size * dma_ns_per_byte);
+    sim->dma_busy = true;
+    return;
+
+error:
+    pr_warn("ap1302-sim: invalid DMA 0x%08x -> 0x%08x (%u bytes, ctrl 0x%04x)\n",
+            src, dst, size, ctrl);
+    ap1302_sim_set16(sim, AP1302_SIM_DMA_CTRL,
+                     ctrl & ~AP1302_SIM_DMA_CTRL_MODE_MASK);
+}
+
+/* Apply the side effects of writing registers in [start, start + len). */
+static void ap1302_sim_written(struct ap1302_sim *sim, u16 start,
+                               unsigned int len)
+{
+    u16 val;
+
+    if (ap1302_sim_touches(start, len, AP1302_SIM_BOOTDATA_STAGE, 2)) {
+        val = ap1302_sim_get16(sim, AP1302_SIM_BOOTDATA_STAGE);
+        if (val == 0x0002) {
+            sim->pll_lock_at = ktime_add_us(ktime_get(), pll_lock_us);
+            sim->pll_locking = true;
+        } else if (val == 0xffff) {
+            sim->boot_at = ktime_add_us(ktime_get(), boot_us);
+            sim->state = AP1302_SIM_VERIFYING;
+        }
+    }
+
+    if (ap1302_sim_touches(start, len, AP1302_SIM_SYS_START, 2)) {
+        val = ap1302_sim_get16(sim, AP1302_SIM_SYS_START);
+
+        /*
+         * Writing STALL_EN without STALL_STATUS stalls the pipeline once
+         * the current frame completes, writing STALL_STATUS resumes it.
+         */
+        sim->stalling = false;
+        if ((val & AP1302_SIM_SYS_START_STALL_EN) &&
+            !(val & AP1302_SIM_SYS_START_STALL_STATUS)) {
+            sim->stall_at = ktime_add_us(ktime_get(), stall_us);
+            sim->stalling = true;
+            if (sim->running) {
+                ap1302_sim_update(sim);
+                sim->running = false;
+            }
+        } else {
+            val &= ~AP1302_SIM_SYS_START_STALL_STATUS;
+            if (sim->state == AP1302_SIM_BOOTED && !sim->running)
+                ap1302_sim_start_frames(sim);
+        }
+
+        /* PLL_LOCK is read-only. */
+        val &= ~AP1302_SIM_SYS_START_PLL_LOCK;
+        if (sim->pll_locked)
+            val |= AP1302_SIM_SYS_START_PLL_LOCK;
+        ap1302_sim_set16(sim, AP1302_SIM_SYS_START, val);
+    }
+
+    if (ap1302_sim_touches(start, len, AP1302_SIM_DMA_CTRL, 2))
+        ap1302_sim_dma(sim, ap1302_sim_get16(sim, AP1302_SIM_DMA_CTRL));
+}
+
+static void ap1302_sim_write(struct ap1302_sim *sim, const u8 *data,
+                             unsigned int len)
+{
+    u16 start = sim->addr;
+
+    if (start >= AP1302_SIM_FW_WINDOW &&
+        start < AP1302_SIM_FW_WINDOW + AP1302_SIM_FW_WINDOW_SIZE) {
+        ap1302_sim_write_window(sim, start - AP1302_SIM_FW_WINDOW, data, len);
+    } else if (start >= AP1302_SIM_ADV_WINDOW &&
+               start < AP1302_SIM_ADV_WINDOW + AP1302_SIM_ADV_WINDOW_SIZE) {
+        unsigned int offset = start - AP1302_SIM_ADV_WINDOW;
+
+        len = min_t(unsigned int, len, AP1302_SIM_ADV_WINDOW_SIZE - offset);
+        memcpy(ap1302_sim_adv_page(sim) + offset, data, len);
+    } else {
+        len = min_t(unsigned int, len, AP1302_SIM_REG_SPACE - start);
+        memcpy(&sim->regs[start], data, len);
+        ap1302_sim_written(sim, start, len);
+    }
+
+    sim->addr += len;
+}
+
+static void ap1302_sim_read(struct ap1302_sim *sim, u8 *data,
+                            unsigned int len)
+{
+    u16 start = sim->addr;
+
+    if (ap1302_sim_touches(start, len, AP1302_SIM_CHIP_VERSION, 2) &&
+        sim->state != AP1302_SIM_LOADING)
+        ap1302_sim_reset(sim);
+
+    ap1302_sim_update(sim);
+
+    if (ap1302_sim_touches(start, len, AP1302_SIM_SIP_CRC, 2))
+        ap1302_sim_set16(sim, AP1302_SIM_SIP_CRC, sim->crc);
+
+    if (start >= AP1302_SIM_ADV_WINDOW &&
+        start < AP1302_SIM_ADV_WINDOW + AP1302_SIM_ADV_WINDOW_SIZE) {
+        unsigned int offset = start - AP1302_SIM_ADV_WINDOW;
+
+        memset(data, 0, len);
+        memcpy(data, ap1302_sim_adv_page(sim) + offset,
+               min_t(unsigned int, len,
+                     AP1302_SIM_ADV_WINDOW_SIZE - offset));
+    } else {
+        memset(data, 0, len);
+        memcpy(data, &sim->regs[start],
+               min_t(unsigned int, len, AP1302_SIM_REG_SPACE - start));
+    }
+
+    sim->addr += len;
+}
+
+/* -----------------------------------------------------------------------------
+ * I2C Adapter
+ */
+
+static int ap1302_sim_xfer(struct i2c_adapter *adapter, struct i2c_msg *msgs,
+                           int num)
+{
+    struct ap1302_sim *sim = i2c_get_adapdata(adapter);
+    unsigned int bytes = 0;
+    int i;
+
+    for (i = 0; i < num; ++i) {
+        if (msgs[i].addr != addr)
+            return -ENXIO;
+        bytes += msgs[i].len;
+    }
+
+    if (xfer_latency_us || byte_ns) {
+        u64 delay_us = xfer_latency_us + div_u64((u64)bytes * byte_ns, 1000);
+
+        usleep_range(delay_us, delay_us + delay_us / 10 + 1);
+    }
+
+    mutex_lock(&sim->lock);
+
+    sim->transfers++;
+    sim->bytes += bytes;
+
+    if (ap1302_sim_chance(nak_rate)) {
+        sim->naks++;
+        mutex_unlock(&sim->lock);
+        return -EIO;
+    }
+
+    for (i = 0; i < num; ++i) {
+        struct i2c_msg *msg = &msgs[i];
+        const u8 *data = msg->buf;
+        unsigned int len = msg->len;
+
+        if (msg->flags & I2C_M_RD) {
+            ap1302_sim_read(sim, msg->buf, len);
+            continue;
+        }
+
+        /* Messages without NOSTART start with the register address. */
+        if (!(msg->flags & I2C_M_NOSTART)) {
+            if (len < 2) {
+                mutex_unlock(&sim->lock);
+                return -EINVAL;
+            }
+            sim->addr = get_unaligned_be16(data);
+            data += 2;
+            len -= 2;
+        }
+
+        if (len)
+            ap1302_sim_write(sim, data, len);
+    }
+
+    mutex_unlock(&sim->lock);
+
+    return num;
+}
+
+static u32 ap1302_sim_functionality(struct i2c_adapter *adapter)
+{
+    return I2C_FUNC_I2C | (nostart ? I2C_FUNC_NOSTART : 0);
+}
+
+static const struct i2c_algorithm ap1302_sim_algo = {
+    .master_xfer = ap1302_sim_xfer,
+    .functionality = ap1302_sim_functionality,
+};
+
+/*
+ * Instantiate the ap1302 client, with its firmware node and xclk. The clock
+ * lookup is keyed by the client device name, it must be registered before the
+ * client probes.
+ */
+static int ap1302_sim_add_client(struct ap1302_sim *sim)
+{
+    struct i2c_board_info info = {
+        .type = "ap1302",
+        .addr = addr,
+        .swnode = &ap1302_sim_node,
+    };
+    int ret;
+
+    switch (data_lanes) {
+    case 1:
+    case 2:
+    case 4:
+        break;
+    default:
+        pr_err("ap1302-sim: invalid number of data lanes %u\n", data_lanes);
+        return -EINVAL;
+    }
+
+    ap1302_sim_ep_props[2] =
+        PROPERTY_ENTRY_U32_ARRAY_LEN("data-lanes", ap1302_sim_data_lanes,
+                                     data_lanes);
+
+    ret = software_node_register_node_group(ap1302_sim_nodes);
+    if (ret)
+        return ret;
+
+    sim->xclk = clk_hw_register_fixed_rate(NULL, "ap1302-sim-xclk", NULL, 0,
+                                           xclk_rate);
+    if (IS_ERR(sim->xclk)) {
+        ret = PTR_ERR(sim->xclk);
+        goto error_nodes;
+    }
+
+    sim->xclk_lookup = clkdev_hw_create(sim->xclk, "xclk", "%d-%04x",
+                                        sim->adapter.nr, addr);
+    if (!sim->xclk_lookup) {
+        ret = -ENOMEM;
+        goto error_clk;
+    }
+
+    sim->client = i2c_new_client_device(&sim->adapter, &info);
+    if (IS_ERR(sim->client)) {
+        ret = PTR_ERR(sim->client);
+        goto error_lookup;
+    }
+
+    return 0;
+
+error_lookup:
+    clkdev_drop(sim->xclk_lookup);
+error_clk:
+    clk_hw_unregister_fixed_rate(sim->xclk);
+error_nodes:
+    software_node_unregister_node_group(ap1302_sim_nodes);
+    return ret;
+}
+
+static void ap1302_sim_remove_client(struct ap1302_sim *sim)
+{
+    i2c_unregister_device(sim->client);
+    clkdev_drop(sim->xclk_lookup);
+    clk_hw_unregister_fixed_rate(sim->xclk);
+    software_node_unregister_node_group(ap1302_sim_nodes);
+}
+
+static int __init ap1302_sim_init(void)
+{
+    struct ap1302_sim *sim;
+    int ret;
+
+    sim = vzalloc(sizeof(*sim));
+    if (!sim)
+        return -ENOMEM;
+
+    sim->adv = vzalloc(AP1302_SIM_ADV_NUM_PAGES * AP1302_SIM_ADV_WINDOW_SIZE);
+    sim->flash = vmalloc(flash_size);
+    if (!sim->adv || !sim->flash) {
+        ret = -ENOMEM;
+        goto error;
+    }
+
+    /* Erased flash. */
+    memset(sim->flash, 0xff, flash_size);
+
+    mutex_init(&sim->lock);
+
+    ap1302_sim_set16(sim, AP1302_SIM_CHIP_VERSION, AP1302_SIM_CHIP_ID);
+    ap1302_sim_set16(sim, AP1302_SIM_CHIP_REV_REG, AP1302_SIM_CHIP_REV);
+    ap1302_sim_reset(sim);
+
+    if (max_write_len) {
+        sim->quirks.max_write_len = max_write_len;
+        sim->adapter.quirks = &sim->quirks;
+    }
+
+    sim->adapter.owner = THIS_MODULE;
+    sim->adapter.algo = &ap1302_sim_algo;
+    strscpy(sim->adapter.name, "AP1302 simulator", sizeof(sim->adapter.name));
+    i2c_set_adapdata(&sim->adapter, sim);
+
+    ret = i2c_add_adapter(&sim->adapter);
+    if (ret)
+        goto error;
+
+    ap1302_sim = sim;
+
+    ret = ap1302_sim_add_client(sim);
+    if (ret) {
+        i2c_del_adapter(&sim->adapter);
+        ap1302_sim = NULL;
+        goto error;
+    }
+
+    pr_info("ap1302-sim: simulated AP1302 at %d-%04x\n", sim->adapter.nr,
+            addr);
+
+    return 0;
+
+error:
+    vfree(sim->flash);
+    vfree(sim->adv);
+    vfree(sim);
+    return ret;
+}
+
+static void __exit ap1302_sim_exit(void)
+{
+    struct ap1302_sim *sim = ap1302_sim;
+
+    ap1302_sim_remove_client(sim);
+    i2c_del_adapter(&sim->adapter);
+
+    pr_info("ap1302-sim: %llu transfers, %llu bytes, %llu NAKs, %llu corrupted bootdata bytes\n",
+            sim->transfers, sim->bytes, sim->naks, sim->corruptions);
+
+    mutex_destroy(&sim->lock);
+    vfree(sim->flash);
+    vfree(sim->adv);
+    vfree(sim);
+}
+
+module_init(ap1302_sim_init);
+module_exit(ap1302_sim_exit);
+
+MODULE_DESCRIPTION("AP1302 register-level simulator");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,116 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * AP1302 boot tracepoints
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ap1302
+
+#if !defined(_AP1302_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AP1302_TRACE_H
+
+#include <linux/i2c.h>
+#include <linux/tracepoint.h>
+
+#define AP1302_BOOT_PHASES                                    \
+    EM(AP1302_PHASE_FW_REQUEST, "fw_request")                 \
+    EM(AP1302_PHASE_SUPPLIES, "supplies")                     \
+    EM(AP1302_PHASE_POWER_ON, "power_on")                     \
+    EM(AP1302_PHASE_DETECT, "detect_chip")                    \
+    EM(AP1302_PHASE_SPI_FLASH, "spi_flash")                   \
+    EM(AP1302_PHASE_PLL_UPLOAD, "pll_upload")                 \
+    EM(AP1302_PHASE_PLL_LOCK, "pll_lock")                     \
+    EM(AP1302_PHASE_UPLOAD, "upload")                         \
+    EM(AP1302_PHASE_CHECKSUM, "checksum")                     \
+    EMe(AP1302_PHASE_MIPI_T3_CLK, "mipi_t3_clk")
+
+#ifndef _AP1302_TRACE_PHASES
+#define _AP1302_TRACE_PHASES
+
+#undef EM
+#undef EMe
+#define EM(a, b)    a,
+#define EMe(a, b)   a
+
+enum ap1302_boot_phase {
+    AP1302_BOOT_PHASES,
+    AP1302_NUM_PHASES
+};
+
+#endif
+
+#undef EM
+#undef EMe
+#define EM(a, b)    TRACE_DEFINE_ENUM(a);
+#define EMe(a, b)   TRACE_DEFINE_ENUM(a);
+
+AP1302_BOOT_PHASES
+
+#undef EM
+#undef EMe
+#define EM(a, b)    { a, b },
+#define EMe(a, b)   { a, b }
+
+TRACE_EVENT(ap1302_boot_phase,
+    TP_PROTO(struct i2c_client *client, enum ap1302_boot_phase phase,
+             u32 bytes, s64 duration_us, int ret),
+    TP_ARGS(client, phase, bytes, duration_us, ret),
+
+    TP_STRUCT__entry(
+        __field(int, bus)
+        __field(u16, addr)
+        __field(unsigned int, phase)
+        __field(u32, bytes)
+        __field(s64, duration_us)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->bus = client->adapter->nr;
+        __entry->addr = client->addr;
+        __entry->phase = phase;
+        __entry->bytes = bytes;
+        __entry->duration_us = duration_us;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("%d-%04x %s bytes=%u duration=%lld us ret=%d",
+              __entry->bus, __entry->addr,
+              __print_symbolic(__entry->phase, AP1302_BOOT_PHASES),
+              __entry->bytes, __entry->duration_us, __entry->ret)
+);
+
+TRACE_EVENT(ap1302_boot,
+    TP_PROTO(struct i2c_client *client, unsigned int retries,
+             s64 duration_us, int ret),
+    TP_ARGS(client, retries, duration_us, ret),
+
+    TP_STRUCT__entry(
+        __field(int, bus)
+        __field(u16, addr)
+        __field(unsigned int, retries)
+        __field(s64, duration_us)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->bus = client->adapter->nr;
+        __entry->addr = client->addr;
+        __entry->retries = retries;
+        __entry->duration_us = duration_us;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("%d-%04x retries=%u duration=%lld us ret=%d",
+              __entry->bus, __entry->addr, __entry->retries,
+              __entry->duration_us, __entry->ret)
+);
+
+#endif /* _AP1302_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ap1302_trace
+
+#include <trace/define_trace.h>